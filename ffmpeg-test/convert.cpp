@@ -0,0 +1,427 @@
+// Hand-written 4:2:0 converters, see convert.h.
+//
+// Every kernel works on one row at a time and leaves the odd samples at
+// the end of a row to the C version, so the frame loops below are shared
+// by all of them. 10-bit samples are rounded to 8 bits as (x + 2) >> 2.
+
+#include "convert.h"
+
+extern "C"
+{
+#include <libavutil/cpu.h>
+#include <libavutil/frame.h>
+#include <libavutil/pixdesc.h>
+#include <libavutil/time.h>
+#include <libswscale/swscale.h>
+}
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define CONVERT_X86 1
+#include <immintrin.h>
+#if defined(__GNUC__) || defined(__clang__)
+#define TARGET_SSE2 __attribute__((target("sse2")))
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define TARGET_SSE2
+#define TARGET_AVX2
+#endif
+#else
+#define CONVERT_X86 0
+#endif
+
+typedef void (*deinterleave_func)(uint8_t *u, uint8_t *v, const uint8_t *uv, int n);
+typedef void (*shift_func)(uint8_t *dst, const uint16_t *src, int n);
+typedef void (*deinterleave16_func)(uint8_t *u, uint8_t *v, const uint16_t *uv, int n);
+
+/* plain C, also does the tails for the SIMD versions */
+
+static void deinterleave_c(uint8_t *u, uint8_t *v, const uint8_t *uv, int n) {
+  for(int i = 0; i < n; i++) {
+    u[i] = uv[2 * i];
+    v[i] = uv[2 * i + 1];
+  }
+}
+
+static inline uint8_t round10(unsigned x) {
+  x = (x + 2) >> 2;
+  return x > 255 ? 255 : x;
+}
+
+static void shift10_c(uint8_t *dst, const uint16_t *src, int n) {
+  for(int i = 0; i < n; i++)
+    dst[i] = round10(src[i]);
+}
+
+/* P010 keeps its 10 bits at the top of each 16-bit word */
+static void p010_luma_c(uint8_t *dst, const uint16_t *src, int n) {
+  for(int i = 0; i < n; i++)
+    dst[i] = round10(src[i] >> 6);
+}
+
+static void p010_chroma_c(uint8_t *u, uint8_t *v, const uint16_t *uv, int n) {
+  for(int i = 0; i < n; i++) {
+    u[i] = round10(uv[2 * i] >> 6);
+    v[i] = round10(uv[2 * i + 1] >> 6);
+  }
+}
+
+#if CONVERT_X86
+
+TARGET_SSE2
+static void deinterleave_sse2(uint8_t *u, uint8_t *v, const uint8_t *uv, int n) {
+  const __m128i mask = _mm_set1_epi16(0x00ff);
+  int i = 0;
+
+  for(; i + 16 <= n; i += 16) {
+    __m128i a = _mm_loadu_si128((const __m128i *)(uv + 2 * i));
+    __m128i b = _mm_loadu_si128((const __m128i *)(uv + 2 * i + 16));
+    _mm_storeu_si128((__m128i *)(u + i),
+                     _mm_packus_epi16(_mm_and_si128(a, mask), _mm_and_si128(b, mask)));
+    _mm_storeu_si128((__m128i *)(v + i),
+                     _mm_packus_epi16(_mm_srli_epi16(a, 8), _mm_srli_epi16(b, 8)));
+  }
+  deinterleave_c(u + i, v + i, uv + 2 * i, n - i);
+}
+
+/* saturating add so out of range samples end up at 255 like in C;
+   packus clamps whatever is above 255 after the shift */
+TARGET_SSE2
+static inline __m128i round10_sse2(__m128i x) {
+  return _mm_srli_epi16(_mm_adds_epu16(x, _mm_set1_epi16(2)), 2);
+}
+
+TARGET_SSE2
+static void shift10_sse2(uint8_t *dst, const uint16_t *src, int n) {
+  int i = 0;
+
+  for(; i + 16 <= n; i += 16) {
+    __m128i a = _mm_loadu_si128((const __m128i *)(src + i));
+    __m128i b = _mm_loadu_si128((const __m128i *)(src + i + 8));
+    _mm_storeu_si128((__m128i *)(dst + i),
+                     _mm_packus_epi16(round10_sse2(a), round10_sse2(b)));
+  }
+  shift10_c(dst + i, src + i, n - i);
+}
+
+TARGET_SSE2
+static void p010_luma_sse2(uint8_t *dst, const uint16_t *src, int n) {
+  int i = 0;
+
+  for(; i + 16 <= n; i += 16) {
+    __m128i a = _mm_srli_epi16(_mm_loadu_si128((const __m128i *)(src + i)), 6);
+    __m128i b = _mm_srli_epi16(_mm_loadu_si128((const __m128i *)(src + i + 8)), 6);
+    _mm_storeu_si128((__m128i *)(dst + i),
+                     _mm_packus_epi16(round10_sse2(a), round10_sse2(b)));
+  }
+  p010_luma_c(dst + i, src + i, n - i);
+}
+
+TARGET_SSE2
+static void p010_chroma_sse2(uint8_t *u, uint8_t *v, const uint16_t *uv, int n) {
+  const __m128i mask = _mm_set1_epi32(0xffff);
+  int i = 0;
+
+  for(; i + 16 <= n; i += 16) {
+    __m128i a = _mm_loadu_si128((const __m128i *)(uv + 2 * i));
+    __m128i b = _mm_loadu_si128((const __m128i *)(uv + 2 * i + 8));
+    __m128i c = _mm_loadu_si128((const __m128i *)(uv + 2 * i + 16));
+    __m128i d = _mm_loadu_si128((const __m128i *)(uv + 2 * i + 24));
+    /* down to 10 bits in 32-bit lanes first, so packs cannot saturate */
+    __m128i ulo = _mm_packs_epi32(_mm_srli_epi32(_mm_and_si128(a, mask), 6),
+                                  _mm_srli_epi32(_mm_and_si128(b, mask), 6));
+    __m128i uhi = _mm_packs_epi32(_mm_srli_epi32(_mm_and_si128(c, mask), 6),
+                                  _mm_srli_epi32(_mm_and_si128(d, mask), 6));
+    __m128i vlo = _mm_packs_epi32(_mm_srli_epi32(a, 22), _mm_srli_epi32(b, 22));
+    __m128i vhi = _mm_packs_epi32(_mm_srli_epi32(c, 22), _mm_srli_epi32(d, 22));
+    _mm_storeu_si128((__m128i *)(u + i),
+                     _mm_packus_epi16(round10_sse2(ulo), round10_sse2(uhi)));
+    _mm_storeu_si128((__m128i *)(v + i),
+                     _mm_packus_epi16(round10_sse2(vlo), round10_sse2(vhi)));
+  }
+  p010_chroma_c(u + i, v + i, uv + 2 * i, n - i);
+}
+
+/* The AVX2 packs work per 128-bit lane, each result goes through
+   permute4x64 to put the quadwords back in order. */
+#define LANE_FIX(x) _mm256_permute4x64_epi64(x, 0xd8)
+
+TARGET_AVX2
+static void deinterleave_avx2(uint8_t *u, uint8_t *v, const uint8_t *uv, int n) {
+  const __m256i mask = _mm256_set1_epi16(0x00ff);
+  int i = 0;
+
+  for(; i + 32 <= n; i += 32) {
+    __m256i a = _mm256_loadu_si256((const __m256i *)(uv + 2 * i));
+    __m256i b = _mm256_loadu_si256((const __m256i *)(uv + 2 * i + 32));
+    _mm256_storeu_si256((__m256i *)(u + i),
+        LANE_FIX(_mm256_packus_epi16(_mm256_and_si256(a, mask), _mm256_and_si256(b, mask))));
+    _mm256_storeu_si256((__m256i *)(v + i),
+        LANE_FIX(_mm256_packus_epi16(_mm256_srli_epi16(a, 8), _mm256_srli_epi16(b, 8))));
+  }
+  deinterleave_c(u + i, v + i, uv + 2 * i, n - i);
+}
+
+TARGET_AVX2
+static inline __m256i round10_avx2(__m256i x) {
+  return _mm256_srli_epi16(_mm256_adds_epu16(x, _mm256_set1_epi16(2)), 2);
+}
+
+TARGET_AVX2
+static void shift10_avx2(uint8_t *dst, const uint16_t *src, int n) {
+  int i = 0;
+
+  for(; i + 32 <= n; i += 32) {
+    __m256i a = _mm256_loadu_si256((const __m256i *)(src + i));
+    __m256i b = _mm256_loadu_si256((const __m256i *)(src + i + 16));
+    _mm256_storeu_si256((__m256i *)(dst + i),
+        LANE_FIX(_mm256_packus_epi16(round10_avx2(a), round10_avx2(b))));
+  }
+  shift10_c(dst + i, src + i, n - i);
+}
+
+TARGET_AVX2
+static void p010_luma_avx2(uint8_t *dst, const uint16_t *src, int n) {
+  int i = 0;
+
+  for(; i + 32 <= n; i += 32) {
+    __m256i a = _mm256_srli_epi16(_mm256_loadu_si256((const __m256i *)(src + i)), 6);
+    __m256i b = _mm256_srli_epi16(_mm256_loadu_si256((const __m256i *)(src + i + 16)), 6);
+    _mm256_storeu_si256((__m256i *)(dst + i),
+        LANE_FIX(_mm256_packus_epi16(round10_avx2(a), round10_avx2(b))));
+  }
+  p010_luma_c(dst + i, src + i, n - i);
+}
+
+TARGET_AVX2
+static void p010_chroma_avx2(uint8_t *u, uint8_t *v, const uint16_t *uv, int n) {
+  const __m256i mask = _mm256_set1_epi32(0xffff);
+  int i = 0;
+
+  for(; i + 32 <= n; i += 32) {
+    __m256i a = _mm256_loadu_si256((const __m256i *)(uv + 2 * i));
+    __m256i b = _mm256_loadu_si256((const __m256i *)(uv + 2 * i + 16));
+    __m256i c = _mm256_loadu_si256((const __m256i *)(uv + 2 * i + 32));
+    __m256i d = _mm256_loadu_si256((const __m256i *)(uv + 2 * i + 48));
+    __m256i ulo = LANE_FIX(_mm256_packs_epi32(_mm256_srli_epi32(_mm256_and_si256(a, mask), 6),
+                                              _mm256_srli_epi32(_mm256_and_si256(b, mask), 6)));
+    __m256i uhi = LANE_FIX(_mm256_packs_epi32(_mm256_srli_epi32(_mm256_and_si256(c, mask), 6),
+                                              _mm256_srli_epi32(_mm256_and_si256(d, mask), 6)));
+    __m256i vlo = LANE_FIX(_mm256_packs_epi32(_mm256_srli_epi32(a, 22), _mm256_srli_epi32(b, 22)));
+    __m256i vhi = LANE_FIX(_mm256_packs_epi32(_mm256_srli_epi32(c, 22), _mm256_srli_epi32(d, 22)));
+    _mm256_storeu_si256((__m256i *)(u + i),
+        LANE_FIX(_mm256_packus_epi16(round10_avx2(ulo), round10_avx2(uhi))));
+    _mm256_storeu_si256((__m256i *)(v + i),
+        LANE_FIX(_mm256_packus_epi16(round10_avx2(vlo), round10_avx2(vhi))));
+  }
+  p010_chroma_c(u + i, v + i, uv + 2 * i, n - i);
+}
+
+#endif /* CONVERT_X86 */
+
+/* frame loops */
+
+template <deinterleave_func deinterleave>
+static void nv12_to_yuv420p(uint8_t *const dst[3], const int dst_linesize[3],
+                            const uint8_t *const src[3], const int src_linesize[3],
+                            int width, int height) {
+  int cw = (width + 1) / 2, ch = (height + 1) / 2;
+
+  for(int y = 0; y < height; y++)
+    memcpy(dst[0] + y * dst_linesize[0], src[0] + y * src_linesize[0], width);
+  for(int y = 0; y < ch; y++)
+    deinterleave(dst[1] + y * dst_linesize[1], dst[2] + y * dst_linesize[2],
+                 src[1] + y * src_linesize[1], cw);
+}
+
+template <shift_func shift>
+static void yuv420p10_to_yuv420p(uint8_t *const dst[3], const int dst_linesize[3],
+                                 const uint8_t *const src[3], const int src_linesize[3],
+                                 int width, int height) {
+  int cw = (width + 1) / 2, ch = (height + 1) / 2;
+
+  for(int y = 0; y < height; y++)
+    shift(dst[0] + y * dst_linesize[0],
+          (const uint16_t *)(src[0] + y * src_linesize[0]), width);
+  for(int p = 1; p < 3; p++) {
+    for(int y = 0; y < ch; y++)
+      shift(dst[p] + y * dst_linesize[p],
+            (const uint16_t *)(src[p] + y * src_linesize[p]), cw);
+  }
+}
+
+template <shift_func luma, deinterleave16_func chroma>
+static void p010_to_yuv420p(uint8_t *const dst[3], const int dst_linesize[3],
+                            const uint8_t *const src[3], const int src_linesize[3],
+                            int width, int height) {
+  int cw = (width + 1) / 2, ch = (height + 1) / 2;
+
+  for(int y = 0; y < height; y++)
+    luma(dst[0] + y * dst_linesize[0],
+         (const uint16_t *)(src[0] + y * src_linesize[0]), width);
+  for(int y = 0; y < ch; y++)
+    chroma(dst[1] + y * dst_linesize[1], dst[2] + y * dst_linesize[2],
+           (const uint16_t *)(src[1] + y * src_linesize[1]), cw);
+}
+
+convert_func convert_find_cpu(enum AVPixelFormat src_fmt, int cpu_flags) {
+  switch(src_fmt) {
+  case AV_PIX_FMT_NV12:
+#if CONVERT_X86
+    if(cpu_flags & AV_CPU_FLAG_AVX2)
+      return nv12_to_yuv420p<deinterleave_avx2>;
+    if(cpu_flags & AV_CPU_FLAG_SSE2)
+      return nv12_to_yuv420p<deinterleave_sse2>;
+#endif
+    return nv12_to_yuv420p<deinterleave_c>;
+  case AV_PIX_FMT_YUV420P10LE:
+#if CONVERT_X86
+    if(cpu_flags & AV_CPU_FLAG_AVX2)
+      return yuv420p10_to_yuv420p<shift10_avx2>;
+    if(cpu_flags & AV_CPU_FLAG_SSE2)
+      return yuv420p10_to_yuv420p<shift10_sse2>;
+#endif
+    return yuv420p10_to_yuv420p<shift10_c>;
+  case AV_PIX_FMT_P010LE:
+#if CONVERT_X86
+    if(cpu_flags & AV_CPU_FLAG_AVX2)
+      return p010_to_yuv420p<p010_luma_avx2, p010_chroma_avx2>;
+    if(cpu_flags & AV_CPU_FLAG_SSE2)
+      return p010_to_yuv420p<p010_luma_sse2, p010_chroma_sse2>;
+#endif
+    return p010_to_yuv420p<p010_luma_c, p010_chroma_c>;
+  default:
+    return NULL;
+  }
+}
+
+convert_func convert_find(enum AVPixelFormat src_fmt) {
+  return convert_find_cpu(src_fmt, av_get_cpu_flags());
+}
+
+/* microbenchmark */
+
+static void bench_fill(AVFrame *frame) {
+  for(int p = 0; p < 4 && frame->buf[p]; p++) {
+    uint8_t *data = frame->buf[p]->data;
+    for(size_t i = 0; i < frame->buf[p]->size; i += 2) {
+      unsigned x = rand() & 1023;
+      if(frame->format == AV_PIX_FMT_P010LE)
+        x <<= 6;
+      else if(frame->format == AV_PIX_FMT_NV12)
+        x = rand() & 0xffff;
+      data[i] = x & 0xff;
+      if(i + 1 < frame->buf[p]->size)
+        data[i + 1] = x >> 8;
+    }
+  }
+}
+
+static AVFrame *bench_frame(enum AVPixelFormat fmt, int width, int height) {
+  AVFrame *frame = av_frame_alloc();
+
+  if(!frame)
+    return NULL;
+  frame->format = fmt;
+  frame->width = width;
+  frame->height = height;
+  if(av_frame_get_buffer(frame, 0) < 0)
+    av_frame_free(&frame);
+  return frame;
+}
+
+/* largest per-sample difference between two yuv420p frames */
+static int bench_diff(AVFrame *a, AVFrame *b) {
+  int diff = 0;
+
+  for(int p = 0; p < 3; p++) {
+    int w = p ? (a->width + 1) / 2 : a->width;
+    int h = p ? (a->height + 1) / 2 : a->height;
+    for(int y = 0; y < h; y++) {
+      const uint8_t *ra = a->data[p] + y * a->linesize[p];
+      const uint8_t *rb = b->data[p] + y * b->linesize[p];
+      for(int x = 0; x < w; x++)
+        diff = FFMAX(diff, abs(ra[x] - rb[x]));
+    }
+  }
+  return diff;
+}
+
+int convert_benchmark(int width, int height, int iterations) {
+  static const enum AVPixelFormat formats[] = {
+    AV_PIX_FMT_NV12, AV_PIX_FMT_P010LE, AV_PIX_FMT_YUV420P10LE,
+  };
+  static const struct {
+    const char *name;
+    int flags;
+  } levels[] = {
+    { "c",    0 },
+    { "sse2", AV_CPU_FLAG_SSE2 },
+    { "avx2", AV_CPU_FLAG_SSE2 | AV_CPU_FLAG_AVX2 },
+  };
+  int cpu_flags = av_get_cpu_flags();
+  int ret = 0;
+
+  fprintf(stderr, "converting %dx%d frames to yuv420p, %d iterations\n",
+          width, height, iterations);
+  for(size_t f = 0; f < FF_ARRAY_ELEMS(formats); f++) {
+    AVFrame *src = bench_frame(formats[f], width, height);
+    AVFrame *ref = bench_frame(AV_PIX_FMT_YUV420P, width, height);
+    AVFrame *dst = bench_frame(AV_PIX_FMT_YUV420P, width, height);
+    struct SwsContext *sws_ctx;
+    double ref_ms = 0;
+    int64_t t;
+
+    if(!src || !ref || !dst) {
+      fprintf(stderr, "out of memory\n");
+      return -1;
+    }
+    bench_fill(src);
+    convert_find_cpu(formats[f], 0)(ref->data, ref->linesize,
+                                     src->data, src->linesize, width, height);
+
+    for(size_t l = 0; l < FF_ARRAY_ELEMS(levels); l++) {
+      convert_func convert = convert_find_cpu(formats[f], levels[l].flags);
+      double ms;
+
+      if((cpu_flags & levels[l].flags) != levels[l].flags)
+        continue;
+      if(l > 0 && convert == convert_find_cpu(formats[f], levels[l - 1].flags))
+        continue; /* no such kernel on this architecture */
+      t = av_gettime_relative();
+      for(int i = 0; i < iterations; i++)
+        convert(dst->data, dst->linesize, src->data, src->linesize, width, height);
+      ms = (av_gettime_relative() - t) / 1000.0 / iterations;
+      if(!l)
+        ref_ms = ms;
+      if(bench_diff(dst, ref)) {
+        fprintf(stderr, "%-12s %-5s does not match the C version\n",
+                av_get_pix_fmt_name(formats[f]), levels[l].name);
+        ret = -1;
+      }
+      fprintf(stderr, "%-12s %-5s %8.3f ms/frame  x%.1f\n",
+              av_get_pix_fmt_name(formats[f]), levels[l].name, ms, ref_ms / ms);
+    }
+
+    sws_ctx = sws_getContext(width, height, formats[f], width, height,
+                             AV_PIX_FMT_YUV420P, SWS_BILINEAR, NULL, NULL, NULL);
+    if(sws_ctx) {
+      double ms;
+      t = av_gettime_relative();
+      for(int i = 0; i < iterations; i++)
+        sws_scale(sws_ctx, (const uint8_t * const *)src->data, src->linesize,
+                  0, height, dst->data, dst->linesize);
+      ms = (av_gettime_relative() - t) / 1000.0 / iterations;
+      fprintf(stderr, "%-12s %-5s %8.3f ms/frame  x%.1f  (max diff %d)\n",
+              av_get_pix_fmt_name(formats[f]), "sws", ms, ref_ms / ms,
+              bench_diff(dst, ref));
+      sws_freeContext(sws_ctx);
+    }
+    av_frame_free(&src);
+    av_frame_free(&ref);
+    av_frame_free(&dst);
+  }
+  return ret;
+}
@@ -0,0 +1,30 @@
+#ifndef CONVERT_H
+#define CONVERT_H
+
+// Hand-written converters for the decoder formats we see most, into the
+// 8-bit planar 4:2:0 layout the YV12 textures hold. Anything not covered
+// here goes through swscale.
+
+extern "C"
+{
+#include <libavutil/pixfmt.h>
+}
+#include <stdint.h>
+
+/* dst/src are Y, U, V planes (src U and V are one interleaved plane for
+   the semi-planar formats); width and height are in luma samples. */
+typedef void (*convert_func)(uint8_t *const dst[3], const int dst_linesize[3],
+                             const uint8_t *const src[3], const int src_linesize[3],
+                             int width, int height);
+
+/* Best converter for src_fmt on this CPU, or NULL. */
+convert_func convert_find(enum AVPixelFormat src_fmt);
+
+/* Same, restricted to the AV_CPU_FLAG_* in cpu_flags (0 is plain C). */
+convert_func convert_find_cpu(enum AVPixelFormat src_fmt, int cpu_flags);
+
+/* Times every converter against sws_scale on the same synthetic frames
+   and checks that the SIMD versions match the C ones. */
+int convert_benchmark(int width, int height, int iterations);
+
+#endif // CONVERT_H
@@ -19,7 +19,17 @@ INCLUDEPATH += $$PWD/SDL2/include
 LIBS += -L$$PWD/lib/SDL2/x64/ -lSDL2
 
 SOURCES += \
-    main.cpp
+    convert.cpp \
+    keyframe_index.cpp \
+    main.cpp \
+    mmap_io.cpp \
+    probe_cache.cpp \
+    readahead_io.cpp
 
 HEADERS += \
-    logger.h
+    convert.h \
+    keyframe_index.h \
+    logger.h \
+    mmap_io.h \
+    probe_cache.h \
+    readahead_io.h
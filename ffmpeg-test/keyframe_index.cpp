@@ -0,0 +1,420 @@
+// Keyframe index sidecar, see keyframe_index.h.
+
+#include "keyframe_index.h"
+
+extern "C"
+{
+#include <libavutil/avconfig.h>
+#include <libavutil/common.h>
+#include <libavutil/intreadwrite.h>
+#include <libavutil/mem.h>
+}
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#define KFI_MAGIC MKTAG('K', 'F', 'I', 'X')
+#define KFI_VERSION 2
+#define KFI_HEADER_SIZE 16
+#define KFI_STREAM_SIZE 24
+#define KFI_ENTRY_SIZE 48
+/* the demuxer's index must hold every keyframe while we build */
+#define KFI_MAX_DEMUXER_INDEX (1 << 30)
+
+/* keyframes of one video stream while reading the file */
+typedef struct IndexBuilder {
+  int stream_index;
+  AVRational time_base;
+  KeyframeEntry *entries;
+  int nb_entries, nb_alloc;
+} IndexBuilder;
+
+int64_t keyframe_entry_ts(const KeyframeEntry *e) {
+  return e->pts != AV_NOPTS_VALUE ? e->pts : e->dts;
+}
+
+static int compare_entries(const void *a, const void *b) {
+  const KeyframeEntry *ea = (const KeyframeEntry *)a;
+  const KeyframeEntry *eb = (const KeyframeEntry *)b;
+  int64_t ta = keyframe_entry_ts(ea), tb = keyframe_entry_ts(eb);
+
+  if(ta != tb)
+    return ta < tb ? -1 : 1;
+  return ea->pos < eb->pos ? -1 : ea->pos > eb->pos;
+}
+
+const KeyframeEntry *keyframe_index_find(const KeyframeIndex *idx, int64_t ts) {
+  int lo = 0, hi = idx->nb_entries - 1, mid;
+
+  if(idx->nb_entries <= 0)
+    return NULL;
+  if(ts < keyframe_entry_ts(&idx->entries[0]))
+    return &idx->entries[0];
+  /* entries[lo] <= ts holds throughout */
+  while(lo < hi) {
+    mid = lo + (hi - lo + 1) / 2;
+    if(keyframe_entry_ts(&idx->entries[mid]) <= ts)
+      lo = mid;
+    else
+      hi = mid - 1;
+  }
+  return &idx->entries[lo];
+}
+
+/* Map the whole file read-only; the view outlives the handles. */
+static const uint8_t *map_file(const char *path, size_t *size) {
+#ifdef _WIN32
+  LARGE_INTEGER file_size;
+  HANDLE file, mapping;
+  const uint8_t *data = NULL;
+
+  file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL,
+                     OPEN_EXISTING, FILE_FLAG_RANDOM_ACCESS, NULL);
+  if(file == INVALID_HANDLE_VALUE)
+    return NULL;
+  if(GetFileSizeEx(file, &file_size) && file_size.QuadPart > 0 &&
+     (uint64_t)file_size.QuadPart <= (uint64_t)SIZE_MAX) {
+    mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    if(mapping) {
+      data = (const uint8_t *)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+      CloseHandle(mapping);
+    }
+    *size = (size_t)file_size.QuadPart;
+  }
+  CloseHandle(file);
+  return data;
+#else
+  struct stat st;
+  void *data;
+  int fd = open(path, O_RDONLY);
+
+  if(fd < 0)
+    return NULL;
+  if(fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_size <= 0 ||
+     (uint64_t)st.st_size > (uint64_t)SIZE_MAX) {
+    close(fd);
+    return NULL;
+  }
+  data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if(data == MAP_FAILED)
+    return NULL;
+  /* seeks binary-search it */
+  madvise(data, (size_t)st.st_size, MADV_RANDOM);
+  *size = (size_t)st.st_size;
+  return (const uint8_t *)data;
+#endif
+}
+
+static void unmap_file(const uint8_t *data, size_t size) {
+#ifdef _WIN32
+  (void)size;
+  UnmapViewOfFile(data);
+#else
+  munmap((void *)data, size);
+#endif
+}
+
+void keyframe_index_free(KeyframeIndex **idx) {
+  if(!*idx)
+    return;
+  if((*idx)->map)
+    unmap_file((*idx)->map, (*idx)->map_size);
+  else
+    av_free((void *)(*idx)->entries);
+  av_freep(idx);
+}
+
+static int builder_add(IndexBuilder *b, const AVPacket *pkt) {
+  KeyframeEntry *e;
+
+  if(b->nb_entries == b->nb_alloc) {
+    int nb_alloc = FFMAX(b->nb_alloc * 2, 256);
+    void *entries = av_realloc_array(b->entries, nb_alloc, sizeof(*b->entries));
+    if(!entries)
+      return AVERROR(ENOMEM);
+    b->entries = (KeyframeEntry *)entries;
+    b->nb_alloc = nb_alloc;
+  }
+  e = &b->entries[b->nb_entries++];
+  e->pts = pkt->pts;
+  e->dts = pkt->dts;
+  e->pos = pkt->pos;
+  e->flags = pkt->flags;
+  e->size = pkt->size;
+  e->index_pos = -1;
+  e->index_ts = AV_NOPTS_VALUE;
+  return 0;
+}
+
+/* Once the whole file has been read, the demuxer's own index holds an
+   entry for every keyframe it can resume at. Keep the position and
+   timestamp it files each one under: fed back to the playing demuxer
+   they are as good as having read that far. */
+static void builder_match_index(IndexBuilder *b, AVStream *st) {
+  int i, j, k;
+
+  for(i = 0; i < b->nb_entries; i++) {
+    KeyframeEntry *e = &b->entries[i];
+    int64_t ts[2] = { e->pts, e->dts };
+
+    for(j = 0; j < 2; j++) {
+      const AVIndexEntry *ie;
+
+      if(ts[j] == AV_NOPTS_VALUE)
+        continue;
+      k = av_index_search_timestamp(st, ts[j], AVSEEK_FLAG_BACKWARD);
+      ie = k >= 0 ? avformat_index_get_entry(st, k) : NULL;
+      if(ie && ie->timestamp == ts[j] && (ie->flags & AVINDEX_KEYFRAME)) {
+        e->index_pos = ie->pos;
+        e->index_ts = ie->timestamp;
+        break;
+      }
+    }
+  }
+}
+
+static int index_write(const char *path, IndexBuilder *builders, int nb_builders) {
+  char tmp[1200];
+  uint8_t buf[KFI_ENTRY_SIZE];
+  uint64_t offset;
+  int i, j;
+  FILE *f;
+
+  snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+  f = fopen(tmp, "wb");
+  if(!f) {
+    fprintf(stderr, "Could not write keyframe index %s\n", tmp);
+    return AVERROR(errno);
+  }
+  AV_WL32(buf, KFI_MAGIC);
+  AV_WL32(buf + 4, KFI_VERSION);
+  AV_WL32(buf + 8, nb_builders);
+  AV_WL32(buf + 12, 0);
+  fwrite(buf, 1, KFI_HEADER_SIZE, f);
+
+  offset = KFI_HEADER_SIZE + (uint64_t)nb_builders * KFI_STREAM_SIZE;
+  for(i = 0; i < nb_builders; i++) {
+    AV_WL32(buf, builders[i].stream_index);
+    AV_WL32(buf + 4, builders[i].time_base.num);
+    AV_WL32(buf + 8, builders[i].time_base.den);
+    AV_WL32(buf + 12, builders[i].nb_entries);
+    AV_WL64(buf + 16, offset);
+    fwrite(buf, 1, KFI_STREAM_SIZE, f);
+    offset += (uint64_t)builders[i].nb_entries * KFI_ENTRY_SIZE;
+  }
+  for(i = 0; i < nb_builders; i++) {
+    for(j = 0; j < builders[i].nb_entries; j++) {
+      const KeyframeEntry *e = &builders[i].entries[j];
+      AV_WL64(buf, e->pts);
+      AV_WL64(buf + 8, e->dts);
+      AV_WL64(buf + 16, e->pos);
+      AV_WL32(buf + 24, e->flags);
+      AV_WL32(buf + 28, e->size);
+      AV_WL64(buf + 32, e->index_pos);
+      AV_WL64(buf + 40, e->index_ts);
+      fwrite(buf, 1, KFI_ENTRY_SIZE, f);
+    }
+  }
+  if(ferror(f) | fclose(f)) {
+    remove(tmp);
+    return AVERROR(EIO);
+  }
+#ifdef _WIN32
+  remove(path);
+#endif
+  if(rename(tmp, path) < 0) {
+    remove(tmp);
+    return AVERROR(errno);
+  }
+  return 0;
+}
+
+int keyframe_index_load(const char *path, int stream_index, KeyframeIndex **out) {
+  KeyframeIndex *idx = NULL;
+  const uint8_t *data;
+  size_t size = 0;
+  uint64_t offset;
+  int nb_streams, i, j, ret = 0;
+
+  *out = NULL;
+  data = map_file(path, &size);
+  if(!data)
+    return 0;
+  if(size < KFI_HEADER_SIZE ||
+     AV_RL32(data) != KFI_MAGIC || AV_RL32(data + 4) != KFI_VERSION)
+    goto end;
+  nb_streams = AV_RL32(data + 8);
+  if(nb_streams < 0 || KFI_HEADER_SIZE + (uint64_t)nb_streams * KFI_STREAM_SIZE > size)
+    goto end;
+
+  for(i = 0; i < nb_streams; i++) {
+    const uint8_t *s = data + KFI_HEADER_SIZE + i * KFI_STREAM_SIZE;
+    uint32_t nb_entries = AV_RL32(s + 12);
+
+    if((int)AV_RL32(s) != stream_index)
+      continue;
+    offset = AV_RL64(s + 16);
+    if(nb_entries > INT_MAX / KFI_ENTRY_SIZE ||
+       offset > (uint64_t)size ||
+       (uint64_t)nb_entries * KFI_ENTRY_SIZE > (uint64_t)size - offset)
+      goto end;
+    idx = (KeyframeIndex *)av_mallocz(sizeof(*idx));
+    if(!idx)
+      goto end;
+    idx->stream_index = stream_index;
+    idx->time_base.num = AV_RL32(s + 4);
+    idx->time_base.den = AV_RL32(s + 8);
+    idx->nb_entries = nb_entries;
+    if(!AV_HAVE_BIGENDIAN && sizeof(KeyframeEntry) == KFI_ENTRY_SIZE &&
+       !(offset & 7)) {
+      /* the file is the array */
+      idx->entries = (const KeyframeEntry *)(data + offset);
+      idx->map = data;
+      idx->map_size = size;
+      data = NULL;
+    } else {
+      KeyframeEntry *entries;
+
+      entries = (KeyframeEntry *)av_malloc_array(FFMAX(nb_entries, 1), sizeof(*entries));
+      if(!entries) {
+        keyframe_index_free(&idx);
+        goto end;
+      }
+      for(j = 0; j < idx->nb_entries; j++) {
+        const uint8_t *p = data + offset + (uint64_t)j * KFI_ENTRY_SIZE;
+        KeyframeEntry *e = &entries[j];
+        e->pts = AV_RL64(p);
+        e->dts = AV_RL64(p + 8);
+        e->pos = AV_RL64(p + 16);
+        e->flags = AV_RL32(p + 24);
+        e->size = AV_RL32(p + 28);
+        e->index_pos = AV_RL64(p + 32);
+        e->index_ts = AV_RL64(p + 40);
+      }
+      idx->entries = entries;
+    }
+    *out = idx;
+    ret = 1;
+    break;
+  }
+
+ end:
+  if(data)
+    unmap_file(data, size);
+  return ret;
+}
+
+int keyframe_index_build(const char *filename, const char *path, int stream_index,
+                         const AVIOInterruptCB *int_cb, KeyframeIndex **out) {
+  AVFormatContext *fmt = NULL;
+  AVPacket *pkt = NULL;
+  IndexBuilder *builders = NULL;
+  int *builder_of = NULL; /* stream index -> builder, -1 for none */
+  int nb_builders = 0, nb_known = 0;
+  int i, ret;
+
+  *out = NULL;
+  fmt = avformat_alloc_context();
+  pkt = av_packet_alloc();
+  if(!fmt || !pkt) {
+    ret = AVERROR(ENOMEM);
+    goto end;
+  }
+  if(int_cb)
+    fmt->interrupt_callback = *int_cb;
+  fmt->max_index_size = KFI_MAX_DEMUXER_INDEX;
+  /* no avformat_find_stream_info: we want packets, not decoded frames,
+     and parsers are set up as packets come in */
+  ret = avformat_open_input(&fmt, filename, NULL, NULL);
+  if(ret < 0)
+    goto end;
+
+  while((ret = av_read_frame(fmt, pkt)) >= 0) {
+    AVStream *st;
+
+    if((unsigned)nb_known < fmt->nb_streams) {
+      /* new streams turn up while reading in some containers */
+      void *p = av_realloc_array(builder_of, fmt->nb_streams, sizeof(*builder_of));
+      if(!p) {
+        ret = AVERROR(ENOMEM);
+        break;
+      }
+      builder_of = (int *)p;
+      p = av_realloc_array(builders, fmt->nb_streams, sizeof(*builders));
+      if(!p) {
+        ret = AVERROR(ENOMEM);
+        break;
+      }
+      builders = (IndexBuilder *)p;
+      for(i = nb_known; i < (int)fmt->nb_streams; i++) {
+        st = fmt->streams[i];
+        builder_of[i] = -1;
+        if(st->codecpar->codec_type == AVMEDIA_TYPE_VIDEO) {
+          builder_of[i] = nb_builders;
+          memset(&builders[nb_builders], 0, sizeof(*builders));
+          builders[nb_builders].stream_index = i;
+          builders[nb_builders].time_base = st->time_base;
+          nb_builders++;
+        } else {
+          /* less for the demuxer to do */
+          st->discard = AVDISCARD_ALL;
+        }
+      }
+      nb_known = fmt->nb_streams;
+    }
+    i = builder_of[pkt->stream_index];
+    if(i >= 0 && (pkt->flags & AV_PKT_FLAG_KEY) &&
+       (pkt->pts != AV_NOPTS_VALUE || pkt->dts != AV_NOPTS_VALUE)) {
+      ret = builder_add(&builders[i], pkt);
+      if(ret < 0)
+        break;
+    }
+    av_packet_unref(pkt);
+  }
+  if(ret != AVERROR_EOF) {
+    /* interrupted or broken: half an index is worse than none */
+    goto end;
+  }
+
+  for(i = 0; i < nb_builders; i++) {
+    builder_match_index(&builders[i], fmt->streams[builders[i].stream_index]);
+    qsort(builders[i].entries, builders[i].nb_entries,
+          sizeof(*builders[i].entries), compare_entries);
+  }
+  ret = index_write(path, builders, nb_builders);
+  for(i = 0; i < nb_builders; i++) {
+    if(builders[i].stream_index != stream_index)
+      continue;
+    *out = (KeyframeIndex *)av_mallocz(sizeof(**out));
+    if(!*out) {
+      ret = AVERROR(ENOMEM);
+      break;
+    }
+    (*out)->stream_index = stream_index;
+    (*out)->time_base = builders[i].time_base;
+    (*out)->nb_entries = builders[i].nb_entries;
+    /* hand the array over */
+    (*out)->entries = builders[i].entries;
+    builders[i].entries = NULL;
+  }
+
+ end:
+  for(i = 0; i < nb_builders; i++)
+    av_free(builders[i].entries);
+  av_free(builders);
+  av_free(builder_of);
+  av_packet_free(&pkt);
+  avformat_close_input(&fmt);
+  return ret;
+}
@@ -0,0 +1,64 @@
+#ifndef KEYFRAME_INDEX_H
+#define KEYFRAME_INDEX_H
+
+// Keyframe index of a media file's video stream, built once by reading
+// every packet and kept in a sidecar file so later seeks can go straight
+// to the keyframe before the target, even in containers whose own index
+// is poor or missing (MPEG-TS, raw streams, some MKVs).
+//
+// Sidecar layout, all fields little-endian; entries are 8-byte aligned
+// and laid out like KeyframeEntry, so on little-endian hosts they are
+// used straight out of the mapped file:
+//   "KFIX", u32 version, u32 nb_streams, u32 0
+//   nb_streams x { i32 stream_index, i32 tb_num, i32 tb_den,
+//                  u32 nb_entries, u64 entries_offset }
+//   entries, per stream, sorted by timestamp:
+//     { i64 pts, i64 dts, i64 pos, u32 flags, u32 size,
+//       i64 index_pos, i64 index_ts }
+
+extern "C"
+{
+#include <libavformat/avformat.h>
+}
+#include <stdint.h>
+
+typedef struct KeyframeEntry {
+  int64_t pts, dts;
+  int64_t pos;    /* byte offset of the packet, -1 if unknown */
+  uint32_t flags; /* AV_PKT_FLAG_* */
+  uint32_t size;
+  /* the demuxer's own index entry for this keyframe, which is where it
+     resumes reading (a cluster for Matroska); index_pos is -1 if the
+     demuxer keeps no index entry for it */
+  int64_t index_pos, index_ts;
+} KeyframeEntry;
+
+typedef struct KeyframeIndex {
+  int stream_index;
+  AVRational time_base;
+  int nb_entries;
+  const KeyframeEntry *entries; /* into map, or owned when map is NULL */
+  const uint8_t *map;
+  size_t map_size;
+} KeyframeIndex;
+
+/* Map the sidecar at path and take the index for stream_index out of
+   it. Returns 1 and sets *out if there is one, 0 if not. */
+int keyframe_index_load(const char *path, int stream_index, KeyframeIndex **out);
+
+/* Read filename from start to end and write the sidecar at path for
+   every video stream; *out gets the index for stream_index. int_cb is
+   polled so a player that closes can stop it. */
+int keyframe_index_build(const char *filename, const char *path, int stream_index,
+                         const AVIOInterruptCB *int_cb, KeyframeIndex **out);
+
+/* Last keyframe at or before ts (in the stream's time base), or the
+   first one if ts is before all of them; NULL for an empty index. */
+const KeyframeEntry *keyframe_index_find(const KeyframeIndex *idx, int64_t ts);
+
+/* The timestamp an entry is sorted by: pts, or dts without one. */
+int64_t keyframe_entry_ts(const KeyframeEntry *e);
+
+void keyframe_index_free(KeyframeIndex **idx);
+
+#endif // KEYFRAME_INDEX_H
@@ -22,6 +22,8 @@ extern "C"
 #include <libswresample/swresample.h>
 #include <libswscale/swscale.h>
 #include <libavutil/avstring.h>
+#include <libavutil/imgutils.h>
+#include <libavutil/pixdesc.h>
 #include <libavutil/opt.h>
 #include <libavutil/time.h>
 
@@ -33,87 +35,299 @@ extern "C"
 #undef main /* Prevents SDL from overriding main() */
 #endif
 #include <stdio.h>
+#include <stdlib.h>
 #include <math.h>
+#include <atomic>
+#include "convert.h"
+#include "keyframe_index.h"
+#include "mmap_io.h"
+#include "probe_cache.h"
+#include "readahead_io.h"
+#ifdef _WIN32
+#include <malloc.h>
+#elif defined(__linux__)
+#include <sys/mman.h>
+#endif
 
 #define SDL_AUDIO_BUFFER_SIZE 1024
 #define MAX_AUDIO_FRAME_SIZE 192000
-#define MAX_AUDIOQ_SIZE (5 * 16 * 1024)
-#define MAX_VIDEOQ_SIZE (5 * 256 * 1024)
+#define MAX_AUDIOQ_DURATION 1.0 /* seconds of audio to buffer ahead */
+#define MAX_VIDEOQ_DURATION 2.0 /* seconds of video to buffer ahead */
+#define MAX_AUDIOQ_SIZE (16 * 1024 * 1024) /* memory ceilings in bytes */
+#define MAX_VIDEOQ_SIZE (256 * 1024 * 1024)
 #define AV_SYNC_THRESHOLD 0.01
 #define AV_NOSYNC_THRESHOLD 10.0
 #define SAMPLE_CORRECTION_PERCENT_MAX 10
 #define AUDIO_DIFF_AVG_NB 20
-#define FF_ALLOC_EVENT   (SDL_USEREVENT)
 #define FF_REFRESH_EVENT (SDL_USEREVENT + 1)
 #define FF_QUIT_EVENT (SDL_USEREVENT + 2)
-#define VIDEO_PICTURE_QUEUE_SIZE 1
-#define DEFAULT_AV_SYNC_TYPE AV_SYNC_VIDEO_MASTER
-
+#define FF_STATS_EVENT (SDL_USEREVENT + 3)
+#define STATS_INTERVAL 5000 /* ms between throughput reports */
+#define MAX_PLAYERS 16
+#define VIDEO_PICTURE_QUEUE_SIZE 3 /* default depth, see -pictq */
+#define VIDEO_PICTURE_QUEUE_MAX 16
+#define DEFAULT_AV_SYNC_TYPE AV_SYNC_AUDIO_MASTER /* video without audio */
+#define PACKET_QUEUE_CAPACITY 1024 /* must be a power of two */
+#define CACHE_LINE_SIZE 64
+#define PRESENT_EARLY_US 500 /* pictures due sooner than this go up now */
+#define READAHEAD_BLOCK_SIZE (1024 * 1024)
+#define AUDIO_AHEAD_MS 200 /* default PCM decoded ahead of the audio device */
+#define MAX_DECODER_THREADS 16
+#define DECODE_LAG_WINDOW 60 /* frames between -autothreads decisions */
+#define DECODE_LAG_RAISE 0.05 /* seconds behind the master clock */
+#define DECODE_SKIP_INTERVAL 500000 /* us between skip level decisions */
+#define DECODE_SKIP_BEHIND 0.1 /* seconds behind before skipping more */
+#define FRAME_POOL_ALIGN 64 /* linesize and plane alignment */
+#define FRAME_POOL_HUGE_PAGE (2 * 1024 * 1024)
+#define MAX_SCALE_THREADS 8
+#define SCALE_CACHE_SIZE 4 /* conversion geometries kept around */
+#define THUMBNAIL_RATIO 16 /* source/display area past which we scale early */
+
+/* Single-producer/single-consumer ring of packets. decode_thread is the
+   only writer and video_thread/audio_callback the only reader, so the
+   fast path is a pair of atomic indices; the mutex and conds are only
+   touched when one side has to sleep on an empty or full ring. The
+   producer and consumer indices live on separate cache lines.
+
+   Every packet carries the queue serial it was queued under. A flush
+   (seek) bumps the serial, which tells the consumer to reset its
+   decoder and to drop anything older, both still in the ring and
+   already pulled out of it, without decoding it.
+
+   The slots double as the stream's packet pool: each one owns an
+   AVPacket shell that is allocated the first time the slot is used and
+   then recycled forever, packets being moved in and out of it with
+   av_packet_move_ref.
+
+   Admission is by buffered media time: reading stops once every queue
+   holds max_duration worth of packets (in time_base units), or as soon
+   as any one of them reaches max_size bytes, an absolute ceiling. The
+   producer then sleeps on the shared
+   read_cond and is woken by the consumer when it has drained the queue
+   back to half of both limits, instead of polling. */
 typedef struct PacketQueue {
-  AVPacketList *first_pkt, *last_pkt;
-  int nb_packets;
-  int size;
-  SDL_mutex *mutex;
-  SDL_cond *cond;
+  /* written by the producer */
+  alignas(CACHE_LINE_SIZE) std::atomic<unsigned int> windex;
+  std::atomic<int>          serial;
+  std::atomic<int>          put_waiting; /* cleared by the consumer */
+  std::atomic<int>          nb_put;      /* packets queued */
+  std::atomic<int>          nb_allocs;   /* shells allocated */
+  std::atomic<int>          nb_copies;   /* non-refcounted packets copied */
+  /* written by the consumer */
+  alignas(CACHE_LINE_SIZE) std::atomic<unsigned int> rindex;
+  std::atomic<int>          get_waiting;
+  alignas(CACHE_LINE_SIZE) std::atomic<int> size;
+  std::atomic<int64_t>      duration;
+  std::atomic<int>          abort_request;
+  alignas(CACHE_LINE_SIZE) AVPacket *pkts[PACKET_QUEUE_CAPACITY];
+  int                       serials[PACKET_QUEUE_CAPACITY];
+  AVRational                time_base;
+  int64_t                   default_duration; /* for packets without one */
+  int64_t                   max_duration;
+  int                       max_size;
+  SDL_mutex                 *mutex;
+  SDL_cond                  *cond;       /* a packet has been queued */
+  SDL_mutex                 *read_mutex; /* owned by the VideoState */
+  SDL_cond                  *read_cond;  /* the queue has drained */
 } PacketQueue;
+/* Single-producer/single-consumer ring of S16 PCM between audio_thread
+   and the SDL audio callback. The callback never blocks: it takes what
+   is there and pads the rest with silence, counting an underrun.
+   audio_thread keeps up to `target` bytes decoded ahead and sleeps on
+   cond otherwise; the callback only takes the mutex to wake it. */
+typedef struct AudioRing {
+  /* written by audio_thread */
+  alignas(CACHE_LINE_SIZE) std::atomic<unsigned int> windex; /* bytes written */
+  std::atomic<unsigned int> flush_index; /* bytes before this are stale */
+  std::atomic<int>          put_waiting;
+  /* written by the callback */
+  alignas(CACHE_LINE_SIZE) std::atomic<unsigned int> rindex; /* bytes read */
+  std::atomic<int>          underruns;
+  alignas(CACHE_LINE_SIZE) uint8_t *data;
+  unsigned int              capacity; /* bytes, a power of two */
+  unsigned int              target;   /* bytes to keep buffered */
+  int                       bytes_per_sec;
+  std::atomic<int>          abort_request;
+  SDL_mutex                 *mutex;
+  SDL_cond                  *cond;    /* the callback has consumed data */
+} AudioRing;
 typedef struct VideoPicture {
   //SDL_Overlay *bmp;
-    SDL_Renderer *render;
     SDL_Texture  *texture;
-  int width, height; /* source height & width */
-  int allocated;
+  Uint32 texture_format; /* what the texture was created with, only */
+  int texture_width, texture_height; /* ever changed by the main thread */
+  Uint32 format; /* SDL_PIXELFORMAT_* the picture needs */
+  int width, height; /* picture height & width */
+  int frame_width, frame_height; /* what was decoded, may be larger */
+  AVRational sar;
+  AVFrame *frame; /* reference for picture_upload */
+  AVFrame *convert_frame; /* conversion output, reused while the size holds */
+  int upload;
   double pts;
+  int serial;
 } VideoPicture;
 
+/* Decoder frame buffers for one geometry, one pool per plane. Rebuilt
+   when the decoder asks for a different size or format; frames still
+   out there keep the old pools alive until they are released. */
+typedef struct FramePool {
+  int format, width, height;
+  int linesize[4];
+  AVBufferPool *pools[4];
+  SDL_mutex *mutex; /* get_buffer2 runs on every frame thread */
+} FramePool;
+
+/* Colour conversion split into horizontal output slices. Each worker
+   has an SwsContext for the whole frame and only renders its own rows
+   of it (sws_receive_slice), so the workers never share scaler state.
+   Worker 0 is the calling thread itself. */
+typedef struct ScaleWorker {
+  struct ScalePool *pool;
+  SDL_Thread *tid;
+  struct SwsContext *sws_ctx; /* borrowed from the current ScaleContexts */
+  int slice_start, slice_height;
+  int ret;
+} ScaleWorker;
+
+/* One set of worker contexts per conversion geometry, so that streams
+   switching back and forth between resolutions (or a window flipping
+   between two sizes) do not rebuild them every time. */
+typedef struct ScaleContexts {
+  int src_w, src_h, src_fmt;
+  int dst_w, dst_h, dst_fmt;
+  int64_t last_used;
+  struct SwsContext *sws_ctx[MAX_SCALE_THREADS];
+} ScaleContexts;
+
+typedef struct ScalePool {
+  ScaleWorker workers[MAX_SCALE_THREADS];
+  int nb_workers;
+  ScaleContexts cache[SCALE_CACHE_SIZE];
+  int64_t uses;
+  int nb_builds; /* cache misses, see print_stats */
+  AVFrame *src, *dst; /* the job in progress */
+  int job; /* bumped for every frame, workers wait for a new value */
+  int pending; /* workers still busy with the current job */
+  int quit;
+  SDL_mutex *mutex;
+  SDL_cond *work_cond, *done_cond;
+} ScalePool;
+
 typedef struct VideoState {
   AVFormatContext *pFormatCtx;
   AVCodecContext  *audio_codec_ctx;
   AVCodecContext  *video_codec_ctx;
   int             videoStream, audioStream;
 
-  int             av_sync_type;
+  std::atomic<int> av_sync_type; /* settled before the decoders start */
   double          external_clock; /* external clock base */
   int64_t         external_clock_time;
   int             seek_req;
   int             seek_flags;
   int64_t         seek_pos;
-
-  double          audio_clock;
+  std::atomic<double> seek_target; /* decoded up to here but not shown or played */
+  std::atomic<int> seek_target_serial; /* videoq serial seek_target is for */
+  std::atomic<int> audio_seek_target_serial; /* same for audioq */
+  int64_t         seek_req_time; /* av_gettime_relative of the request */
+  std::atomic<int64_t> seek_start_time; /* of the seek whose first picture is due */
+  int             seek_start_preroll; /* frames_preroll when it started */
+  int             seek_exact;
+  std::atomic<KeyframeIndex *> kf_index; /* of the video stream, once known */
+  char            index_path[1200]; /* keyframe index sidecar */
+  int             kf_index_fed; /* handed to the demuxer, decode_thread only */
+  SDL_Thread      *index_tid;
+  int             paused;
+  int64_t         pause_time;
+  SDL_mutex       *continue_read_mutex;
+  SDL_cond        *continue_read_cond;
+
+  double          audio_clock; /* audio_thread's own, see audio_ring_clock */
+  std::atomic<double> audio_ring_clock; /* pts where the ring's data ends */
   AVStream        *audio_st;
   PacketQueue     audioq;
   AVFrame         audio_frame;
   uint8_t         audio_buf[(MAX_AUDIO_FRAME_SIZE * 3) / 2];
-  unsigned int    audio_buf_size;
-  unsigned int    audio_buf_index;
+  AudioRing       audio_ring;
   AVPacket        audio_pkt;
-  uint8_t         *audio_pkt_data;
-  int             audio_pkt_size;
+  int             audio_pkt_serial; /* serial of the last packet decoded */
+  SDL_AudioDeviceID audio_dev;
   int             audio_hw_buf_size;
   double          audio_diff_cum; /* used for AV difference average computation */
   double          audio_diff_avg_coef;
   double          audio_diff_threshold;
   int             audio_diff_avg_count;
   double          frame_timer;
+  std::atomic<double> video_schedule; /* frame_timer - pts of the picture
+                                         shown last: when pts 0 is due */
   double          frame_last_pts;
   double          frame_last_delay;
   double          video_clock; ///<pts of last decoded frame / predicted pts of next decoded frame
   double          video_current_pts; ///<current displayed pts (different from video_clock if frame fifos are used)
   int64_t         video_current_pts_time;  ///<time (av_gettime) at which we updated video_current_pts - used to have running video pts
+  int             video_current_serial; ///<serial of the picture on screen
+  int             video_pkt_serial; ///<serial of the last packet decoded
+  FramePool       frame_pool; ///<see our_get_buffer
+  int             video_threads; /* decoder thread count in use */
+  int             video_threads_want; /* applied at the next keyframe */
+  int             video_threads_floor; /* never lowered below, see -autothreads */
+  double          decode_lag_cum; /* master clock minus decoded pts */
+  int             decode_lag_count;
+  int             skip_level; /* see video_decoder_update_skip */
+  double          skip_lag_cum;
+  int             skip_lag_count;
+  int64_t         skip_time; /* av_gettime of the last decision */
   AVStream        *video_st;
   PacketQueue     videoq;
-  VideoPicture    pictq[VIDEO_PICTURE_QUEUE_SIZE];
+  VideoPicture    pictq[VIDEO_PICTURE_QUEUE_MAX];
+  int             pictq_depth; /* slots of pictq in use */
   int             pictq_size, pictq_rindex, pictq_windex;
   SDL_mutex       *pictq_mutex;
   SDL_cond        *pictq_cond;
+  int64_t         present_due; /* av_gettime_relative of the next refresh,
+                                  -1 to wait for present_wake */
+  std::atomic<int> refresh_pending; /* an FF_REFRESH_EVENT is queued */
   SDL_Thread      *parse_tid;
   SDL_Thread      *video_tid;
+  SDL_Thread      *audio_tid;
+
+  SDL_Window      *window;
+  SDL_Renderer    *renderer;
+  SDL_RendererInfo renderer_info; /* texture formats we can upload as-is */
+  Uint32          prealloc_format; /* see alloc_pictures */
+  int             prealloc_width, prealloc_height;
+  std::atomic<int> prealloc_pending; /* set after the three above */
+  std::atomic<int> window_w, window_h; /* kept current by the event loop */
 
   char            filename[1024];
   int             quit;
 
-  AVIOContext     *io_context;
-  struct SwsContext *sws_ctx;
+  /* throughput counters, see print_stats */
+  std::atomic<int64_t> bytes_demuxed;
+  std::atomic<int> frames_decoded;
+  std::atomic<int> frames_displayed;
+  std::atomic<int> frames_dropped; /* too late, skipped by video_refresh */
+  std::atomic<int> frames_late;    /* shown after their due time */
+  std::atomic<int> frames_converted; /* went through sws_scale */
+  std::atomic<int> frames_preroll; /* decoded on the way to a seek target */
+  std::atomic<int64_t> decode_time;  /* us spent in the decoder */
+  std::atomic<int64_t> convert_time; /* us spent converting */
+  std::atomic<int64_t> upload_time;  /* us spent uploading textures */
+  std::atomic<int>  frames_uploaded;
+  int64_t         stats_time;
+  int64_t         stats_bytes;
+  int             stats_decoded, stats_displayed;
+  int64_t         open_time; /* av_gettime_relative at stream_open */
+  int64_t         probe_time; /* us from open to known streams */
+  int             probe_cached; /* streams came from the probe cache */
+  int64_t         stats_io_buffered, stats_io_direct;
+
+  AVIOContext     *io_context; /* our own input, NULL for other protocols */
+  int             io_readahead; /* io_context is readahead_io, not mmap_io */
+  ScalePool       scale_pool;
   struct SwrContext *swr_ctx_audio;
+  enum AVSampleFormat audio_src_fmt; /* input swr_ctx_audio is set up for */
+  AVChannelLayout audio_src_ch_layout;
+  int             audio_src_freq;
 } VideoState;
 
 enum {
@@ -122,124 +336,337 @@ enum {
   AV_SYNC_EXTERNAL_MASTER,
 };
 
-//SDL_Surface     *screen;
-SDL_Window      *window;
-
-/* Since we only have one decoding thread, the Big Struct
-   can be global in case we need it. */
-VideoState *global_video_state;
-AVPacket flush_pkt;
-
-void packet_queue_init(PacketQueue *q) {
-  memset(q, 0, sizeof(PacketQueue));
+/* command line options, shared by every player */
+static int audio_ahead_ms = AUDIO_AHEAD_MS;
+static int pictq_depth = VIDEO_PICTURE_QUEUE_SIZE;
+static int framedrop = 1;
+static int decoder_threads = 0; /* 0 picks from cores and resolution */
+static int autothreads = 0;
+static int decoder_skip = 1;
+static int sync_type = -1; /* -1 for DEFAULT_AV_SYNC_TYPE */
+static int scale_threads = 0; /* 0 picks from cores and resolution */
+static int vsync = 1;
+static int use_mmap = 1;
+static int readahead_blocks = -1; /* -1 maps the file instead */
+static int io_latency_us = 0; /* simulated storage latency per read */
+static int64_t probesize = 0; /* 0 leaves libavformat's defaults */
+static int64_t analyzeduration = 0;
+static const char *probe_cache_dir = NULL; /* set in main, also holds the
+                                             keyframe index sidecars */
+static int use_probe_cache = 1;
+static int keyframe_indexing = 1;
+static int exact_seek = 0;
+
+void packet_queue_init(PacketQueue *q, AVStream *st,
+                       double max_duration, int max_size,
+                       SDL_mutex *read_mutex, SDL_cond *read_cond) {
+  AVRational frame_rate = st->avg_frame_rate;
+
+  memset((void *)q, 0, sizeof(PacketQueue));
+  q->time_base = st->time_base;
+  if(frame_rate.num && frame_rate.den) {
+    /* TS and raw video often leave packet durations unset */
+    q->default_duration = av_rescale_q(1, av_inv_q(frame_rate), st->time_base);
+  }
+  q->max_duration = (int64_t)(max_duration / av_q2d(st->time_base));
+  q->max_size = max_size;
   q->mutex = SDL_CreateMutex();
   q->cond = SDL_CreateCond();
+  q->read_mutex = read_mutex;
+  q->read_cond = read_cond;
+}
+static int64_t packet_queue_pkt_duration(PacketQueue *q, AVPacket *pkt) {
+  return pkt->duration > 0 ? pkt->duration : q->default_duration;
+}
+/* media time currently waiting in the queue */
+double packet_queue_buffered(PacketQueue *q) {
+  return q->duration.load() * av_q2d(q->time_base);
+}
+/* the queue holds all the media time it wants */
+static int packet_queue_enough(PacketQueue *q) {
+  return q->duration.load() > q->max_duration;
+}
+/* hard ceiling: the producer must stop reading whatever the other
+   queues hold */
+static int packet_queue_full(PacketQueue *q) {
+  return q->windex.load() - q->rindex.load() >= PACKET_QUEUE_CAPACITY - 1 ||
+         q->size.load() > q->max_size;
+}
+/* low-water mark: the producer may start reading again */
+static int packet_queue_drained(PacketQueue *q) {
+  return q->windex.load() - q->rindex.load() <= PACKET_QUEUE_CAPACITY / 2 &&
+         q->duration.load() <= q->max_duration / 2 &&
+         q->size.load() <= q->max_size / 2;
 }
+/* Producer side, called with read_mutex held: ask the consumer for a
+   wakeup once the queue has drained. Returns 0 if it already has. */
+static int packet_queue_want_space(PacketQueue *q) {
+  q->put_waiting.store(1);
+  if(packet_queue_drained(q))
+    q->put_waiting.store(0);
+  return q->put_waiting.load();
+}
+/* Consumer side: hand a slot back to the producer and wake it if it
+   is sleeping and the queue is now below its low-water mark. */
+static void packet_queue_advance(PacketQueue *q, unsigned int rindex) {
+  q->rindex.store(rindex + 1);
+  if(q->put_waiting.load() && packet_queue_drained(q) &&
+     q->put_waiting.exchange(0)) {
+    SDL_LockMutex(q->read_mutex);
+    SDL_CondSignal(q->read_cond);
+    SDL_UnlockMutex(q->read_mutex);
+  }
+}
+/* Takes ownership of the packet's data; pkt is left blank on success. */
 int packet_queue_put(PacketQueue *q, AVPacket *pkt) {
 
-  AVPacketList *pkt1;
+  unsigned int windex = q->windex.load(std::memory_order_relaxed);
+  AVPacket *slot;
 
-  if(pkt != &flush_pkt)
-  {
-      AVPacket *newpacket = av_packet_alloc();
-      if(!newpacket)
-          return -1;
-      if(av_packet_ref(newpacket,pkt) < 0)
-      {
-          av_packet_free(&newpacket);
-          return -1;
-      }
-    pkt = newpacket;
+  if(windex - q->rindex.load(std::memory_order_acquire) >= PACKET_QUEUE_CAPACITY) {
+    /* ring is full, sleep until the consumer has drained it */
+    SDL_LockMutex(q->read_mutex);
+    packet_queue_want_space(q);
+    while(q->put_waiting.load() && !q->abort_request) {
+      SDL_CondWait(q->read_cond, q->read_mutex);
+    }
+    q->put_waiting.store(0);
+    SDL_UnlockMutex(q->read_mutex);
+    if(q->abort_request)
+      return -1;
   }
-  pkt1 = (AVPacketList*)av_malloc(sizeof(AVPacketList));
-  if (!pkt1)
-    return -1;
-  pkt1->pkt = *pkt;
-  pkt1->next = NULL;
-
-  SDL_LockMutex(q->mutex);
-
-  if (!q->last_pkt)
-    q->first_pkt = pkt1;
-  else
-    q->last_pkt->next = pkt1;
-  q->last_pkt = pkt1;
-  q->nb_packets++;
-  q->size += pkt1->pkt.size;
-  SDL_CondSignal(q->cond);
 
-  SDL_UnlockMutex(q->mutex);
+  slot = q->pkts[windex & (PACKET_QUEUE_CAPACITY - 1)];
+  if(!slot) {
+    slot = av_packet_alloc();
+    if(!slot)
+      return -1;
+    q->pkts[windex & (PACKET_QUEUE_CAPACITY - 1)] = slot;
+    q->nb_allocs.fetch_add(1, std::memory_order_relaxed);
+  }
+  if(!pkt->buf) {
+    /* the data belongs to the demuxer, we have to copy it */
+    if(av_packet_make_refcounted(pkt) < 0)
+      return -1;
+    q->nb_copies.fetch_add(1, std::memory_order_relaxed);
+  }
+  av_packet_move_ref(slot, pkt);
+  q->serials[windex & (PACKET_QUEUE_CAPACITY - 1)] = q->serial.load(std::memory_order_relaxed);
+  q->nb_put.fetch_add(1, std::memory_order_relaxed);
+  q->size += slot->size;
+  q->duration += packet_queue_pkt_duration(q, slot);
+  q->windex.store(windex + 1);
+  if(q->get_waiting.load()) {
+    SDL_LockMutex(q->mutex);
+    SDL_CondSignal(q->cond);
+    SDL_UnlockMutex(q->mutex);
+  }
   return 0;
 }
-static int packet_queue_get(PacketQueue *q, AVPacket *pkt, int block)
+static int packet_queue_get(PacketQueue *q, AVPacket *pkt, int block, int *serial)
 {
-  AVPacketList *pkt1;
-  int ret;
-
-  SDL_LockMutex(q->mutex);
+  unsigned int rindex = q->rindex.load(std::memory_order_relaxed);
+  AVPacket *slot;
 
   for(;;) {
 
-    if(global_video_state->quit) {
-      ret = -1;
-      break;
+    if(q->abort_request) {
+      return -1;
+    }
+
+    /* drop everything the producer queued before its last flush */
+    while(rindex != q->windex.load(std::memory_order_acquire) &&
+          q->serials[rindex & (PACKET_QUEUE_CAPACITY - 1)] !=
+          q->serial.load(std::memory_order_acquire)) {
+      slot = q->pkts[rindex & (PACKET_QUEUE_CAPACITY - 1)];
+      q->size -= slot->size;
+      q->duration -= packet_queue_pkt_duration(q, slot);
+      av_packet_unref(slot);
+      packet_queue_advance(q, rindex++);
     }
 
-    pkt1 = q->first_pkt;
-    if (pkt1) {
-      q->first_pkt = pkt1->next;
-      if (!q->first_pkt)
-    q->last_pkt = NULL;
-      q->nb_packets--;
-      q->size -= pkt1->pkt.size;
-      *pkt = pkt1->pkt;
-      av_free(pkt1);
-      ret = 1;
+    if(rindex != q->windex.load(std::memory_order_acquire)) {
       break;
     } else if (!block) {
-      ret = 0;
-      break;
+      return 0;
     } else {
-      SDL_CondWait(q->cond, q->mutex);
+      SDL_LockMutex(q->mutex);
+      q->get_waiting.store(1);
+      while(rindex == q->windex.load() && !q->abort_request) {
+        SDL_CondWait(q->cond, q->mutex);
+      }
+      q->get_waiting.store(0);
+      SDL_UnlockMutex(q->mutex);
     }
   }
-  SDL_UnlockMutex(q->mutex);
-  return ret;
+
+  slot = q->pkts[rindex & (PACKET_QUEUE_CAPACITY - 1)];
+  q->size -= slot->size;
+  q->duration -= packet_queue_pkt_duration(q, slot);
+  av_packet_move_ref(pkt, slot);
+  *serial = q->serials[rindex & (PACKET_QUEUE_CAPACITY - 1)];
+  packet_queue_advance(q, rindex);
+  return 1;
 }
+/* Must only be called from the producer thread. The stale packets are
+   released by the consumer the next time it calls packet_queue_get. */
 static void packet_queue_flush(PacketQueue *q) {
-  AVPacketList *pkt, *pkt1;
-
+  q->serial.fetch_add(1, std::memory_order_release);
+}
+/* After the ring has wrapped once nb_allocs stops growing: steady-state
+   playback costs no packet allocation at all. */
+static void packet_queue_dump_stats(PacketQueue *q, const char *name) {
+  fprintf(stderr, "%s: %d packets queued, %d shells allocated, %d copied, "
+          "%.2fs / %d bytes buffered\n",
+          name, q->nb_put.load(), q->nb_allocs.load(), q->nb_copies.load(),
+          packet_queue_buffered(q), q->size.load());
+}
+/* Make both sides give up and wake the consumer. The producer is woken
+   through read_cond by the owner. */
+static void packet_queue_abort(PacketQueue *q) {
+  q->abort_request = 1;
   SDL_LockMutex(q->mutex);
-  for(pkt = q->first_pkt; pkt != NULL; pkt = pkt1) {
-    pkt1 = pkt->next;
-    av_packet_unref(&pkt->pkt);
-    av_freep(&pkt);
-  }
-  q->last_pkt = NULL;
-  q->first_pkt = NULL;
-  q->nb_packets = 0;
-  q->size = 0;
+  SDL_CondBroadcast(q->cond);
   SDL_UnlockMutex(q->mutex);
 }
+static void packet_queue_destroy(PacketQueue *q) {
+  int i;
+
+  for(i = 0; i < PACKET_QUEUE_CAPACITY; i++) {
+    av_packet_free(&q->pkts[i]);
+  }
+  SDL_DestroyCond(q->cond);
+  SDL_DestroyMutex(q->mutex);
+}
+int audio_ring_init(AudioRing *r, int bytes_per_sec, int ahead_ms) {
+  memset((void *)r, 0, sizeof(AudioRing));
+  r->bytes_per_sec = bytes_per_sec;
+  r->target = (unsigned int)av_rescale(bytes_per_sec, ahead_ms, 1000);
+  r->capacity = 1;
+  while(r->capacity < 2 * r->target)
+    r->capacity <<= 1;
+  r->data = (uint8_t *)av_malloc(r->capacity);
+  if(!r->data)
+    return -1;
+  r->mutex = SDL_CreateMutex();
+  r->cond = SDL_CreateCond();
+  return 0;
+}
+/* bytes still to be played; anything before flush_index is skipped by
+   the callback and never will be */
+static unsigned int audio_ring_fill(AudioRing *r) {
+  unsigned int flush_index = r->flush_index.load();
+  unsigned int rindex = r->rindex.load();
+
+  if((int)(flush_index - rindex) > 0)
+    rindex = flush_index;
+  return r->windex.load() - rindex;
+}
+/* buffered audio in milliseconds, i.e. how far ahead audio_thread is */
+int audio_ring_fill_ms(AudioRing *r) {
+  return r->bytes_per_sec ? (int)av_rescale(audio_ring_fill(r), 1000, r->bytes_per_sec) : 0;
+}
+/* audio_thread side; blocks while the ring is `target` bytes ahead */
+int audio_ring_write(AudioRing *r, const uint8_t *buf, int len) {
+  unsigned int windex = r->windex.load(std::memory_order_relaxed);
+  unsigned int n, off;
+
+  while(len > 0) {
+    if(windex - r->rindex.load() >= r->target) {
+      SDL_LockMutex(r->mutex);
+      r->put_waiting.store(1);
+      while(windex - r->rindex.load() >= r->target && !r->abort_request) {
+        SDL_CondWait(r->cond, r->mutex);
+      }
+      r->put_waiting.store(0);
+      SDL_UnlockMutex(r->mutex);
+      if(r->abort_request)
+        return -1;
+    }
+    n = FFMIN((unsigned int)len, r->capacity - (windex - r->rindex.load()));
+    off = windex & (r->capacity - 1);
+    if(n > r->capacity - off) {
+      memcpy(r->data + off, buf, r->capacity - off);
+      memcpy(r->data, buf + r->capacity - off, n - (r->capacity - off));
+    } else {
+      memcpy(r->data + off, buf, n);
+    }
+    windex += n;
+    r->windex.store(windex);
+    buf += n;
+    len -= n;
+  }
+  return 0;
+}
+/* Callback side; never blocks. Returns the number of bytes copied. */
+int audio_ring_read(AudioRing *r, uint8_t *buf, int len) {
+  unsigned int rindex = r->rindex.load(std::memory_order_relaxed);
+  unsigned int flush_index = r->flush_index.load(std::memory_order_acquire);
+  unsigned int n, off;
+
+  if((int)(flush_index - rindex) > 0) {
+    /* decoded before the last seek */
+    rindex = flush_index;
+  }
+  n = FFMIN((unsigned int)len, r->windex.load(std::memory_order_acquire) - rindex);
+  off = rindex & (r->capacity - 1);
+  if(n > r->capacity - off) {
+    memcpy(buf, r->data + off, r->capacity - off);
+    memcpy(buf + r->capacity - off, r->data, n - (r->capacity - off));
+  } else {
+    memcpy(buf, r->data + off, n);
+  }
+  r->rindex.store(rindex + n);
+  if(r->put_waiting.load()) {
+    SDL_LockMutex(r->mutex);
+    SDL_CondSignal(r->cond);
+    SDL_UnlockMutex(r->mutex);
+  }
+  return n;
+}
+/* audio_thread side: drop everything written so far */
+static void audio_ring_flush(AudioRing *r) {
+  r->flush_index.store(r->windex.load(std::memory_order_relaxed),
+                       std::memory_order_release);
+}
+static void audio_ring_abort(AudioRing *r) {
+  r->abort_request = 1;
+  SDL_LockMutex(r->mutex);
+  SDL_CondSignal(r->cond);
+  SDL_UnlockMutex(r->mutex);
+}
+static void audio_ring_destroy(AudioRing *r) {
+  av_freep(&r->data);
+  SDL_DestroyCond(r->cond);
+  SDL_DestroyMutex(r->mutex);
+}
+/* Wake decode_thread out of any of its waits: queues full, paused or
+   end of file. */
+static void wake_read_thread(VideoState *is) {
+  SDL_LockMutex(is->continue_read_mutex);
+  SDL_CondSignal(is->continue_read_cond);
+  SDL_UnlockMutex(is->continue_read_mutex);
+}
 double get_audio_clock(VideoState *is) {
   double pts;
-  int hw_buf_size, bytes_per_sec, n;
+  int bytes_per_sec;
 
-  pts = is->audio_clock; /* maintained in the audio thread */
-  hw_buf_size = is->audio_buf_size - is->audio_buf_index;
-  bytes_per_sec = 0;
-  n = is->audio_st->codecpar->channels * 2;
-  if(is->audio_st) {
-    bytes_per_sec = is->audio_st->codecpar->sample_rate * n;
-  }
+  pts = is->audio_ring_clock; /* published by the audio thread */
+  bytes_per_sec = is->audio_ring.bytes_per_sec;
   if(bytes_per_sec) {
-    pts -= (double)hw_buf_size / bytes_per_sec;
+    /* minus what is decoded but not played yet, in the ring and in the
+       buffer last handed to the device */
+    pts -= (double)(audio_ring_fill(&is->audio_ring) + is->audio_hw_buf_size) /
+           bytes_per_sec;
   }
   return pts;
 }
 double get_video_clock(VideoState *is) {
   double delta;
 
+  if(is->paused) {
+    return is->video_current_pts;
+  }
   delta = (av_gettime() - is->video_current_pts_time) / 1000000.0;
   return is->video_current_pts + delta;
 }
@@ -262,7 +689,7 @@ int synchronize_audio(VideoState *is, short *samples,
   int n;
   double ref_clock;
 
-  n = 2 * is->audio_st->codecpar->channels;
+  n = 2 * is->audio_st->codecpar->ch_layout.nb_channels;
 
   if(is->av_sync_type != AV_SYNC_AUDIO_MASTER) {
     double diff, avg_diff;
@@ -317,278 +744,304 @@ int synchronize_audio(VideoState *is, short *samples,
   return samples_size;
 }
 
-int decode_frame_from_packet(VideoState *is, AVFrame decoded_frame)
+/* Convert a decoded audio frame to packed S16 straight into audio_buf.
+   The resampler is set up once and only rebuilt when the input format,
+   layout or rate changes, so the steady state allocates nothing. */
+int decode_frame_from_packet(VideoState *is, AVFrame *decoded_frame)
 {
-    int64_t     src_ch_layout, dst_ch_layout;
-    int         src_rate, dst_rate;
-    uint8_t     **src_data = NULL, **dst_data = NULL;
-    int         src_nb_channels = 0, dst_nb_channels = 0;
-    int         dst_linesize;
-    int         src_nb_samples, dst_nb_samples, max_dst_nb_samples;
-    enum AVSampleFormat src_sample_fmt, dst_sample_fmt;
-    int         dst_bufsize;
+    AVChannelLayout ch_layout;
+    uint8_t     *out[1] = { is->audio_buf };
+    int         nb_channels, out_count;
     int         ret;
 
-    src_nb_samples = decoded_frame.nb_samples;
-    //src_linesize = (int) decoded_frame.linesize;
-    src_data = decoded_frame.data;
-
-    if (decoded_frame.channel_layout == 0) {
-        decoded_frame.channel_layout = av_get_default_channel_layout(decoded_frame.channels);
-    }
-
-    src_rate = decoded_frame.sample_rate;
-    dst_rate = decoded_frame.sample_rate;
-    src_ch_layout = decoded_frame.channel_layout;
-    dst_ch_layout = decoded_frame.channel_layout;
-    src_sample_fmt = (enum AVSampleFormat)decoded_frame.format;
-    dst_sample_fmt = AV_SAMPLE_FMT_S16;
-
-    //创建新的SwsContext
-    is->swr_ctx_audio = (struct SwrContext*)swr_alloc();
-    if(!is->swr_ctx_audio)
-    {
-        fprintf(stderr, "Failed to allocate SwrContext\n");
-        return -1;
-    }
-    av_opt_set_int(is->swr_ctx_audio, "in_channel_layout", src_ch_layout, 0);
-    av_opt_set_int(is->swr_ctx_audio, "out_channel_layout", dst_ch_layout,  0);
-    av_opt_set_int(is->swr_ctx_audio, "in_sample_rate", src_rate, 0);
-    av_opt_set_int(is->swr_ctx_audio, "out_sample_rate", dst_rate, 0);
-    av_opt_set_sample_fmt(is->swr_ctx_audio, "in_sample_fmt", src_sample_fmt, 0);
-    av_opt_set_sample_fmt(is->swr_ctx_audio, "out_sample_fmt", dst_sample_fmt,  0);
-
-    /* initialize the resampling context */
-    if ((ret = swr_init(is->swr_ctx_audio)) < 0) {
-        fprintf(stderr, "Failed to initialize the resampling context\n");
-        return -1;
-    }
-
-    /* allocate source and destination samples buffers */
-    src_nb_channels = av_get_channel_layout_nb_channels(src_ch_layout);
-    ret = av_samples_alloc_array_and_samples(&src_data, decoded_frame.linesize, src_nb_channels, src_nb_samples, src_sample_fmt, 0);
-    if (ret < 0) {
-        fprintf(stderr, "Could not allocate source samples\n");
+    nb_channels = decoded_frame->ch_layout.nb_channels;
+    if (decoded_frame->ch_layout.order == AV_CHANNEL_ORDER_UNSPEC) {
+        av_channel_layout_default(&ch_layout, nb_channels);
+    } else if (av_channel_layout_copy(&ch_layout, &decoded_frame->ch_layout) < 0) {
         return -1;
     }
 
-    /* compute the number of converted samples: buffering is avoided
-     * ensuring that the output buffer will contain at least all the
-     * converted input samples */
-    max_dst_nb_samples = dst_nb_samples = av_rescale_rnd(src_nb_samples, dst_rate, src_rate, AV_ROUND_UP);
-
-    /* buffer is going to be directly written to a rawaudio file, no alignment */
-    dst_nb_channels = av_get_channel_layout_nb_channels(dst_ch_layout);
-    ret = av_samples_alloc_array_and_samples(&dst_data, &dst_linesize, dst_nb_channels, dst_nb_samples, dst_sample_fmt, 0);
-    if (ret < 0) {
-        fprintf(stderr, "Could not allocate destination samples\n");
-        return -1;
+    if (!swr_is_initialized(is->swr_ctx_audio) ||
+        decoded_frame->format != is->audio_src_fmt ||
+        av_channel_layout_compare(&ch_layout, &is->audio_src_ch_layout) ||
+        decoded_frame->sample_rate != is->audio_src_freq) {
+        av_opt_set_chlayout(is->swr_ctx_audio, "in_chlayout", &ch_layout, 0);
+        av_opt_set_chlayout(is->swr_ctx_audio, "out_chlayout", &ch_layout,  0);
+        av_opt_set_int(is->swr_ctx_audio, "in_sample_rate", decoded_frame->sample_rate, 0);
+        av_opt_set_int(is->swr_ctx_audio, "out_sample_rate", decoded_frame->sample_rate, 0);
+        av_opt_set_sample_fmt(is->swr_ctx_audio, "in_sample_fmt", (enum AVSampleFormat)decoded_frame->format, 0);
+        av_opt_set_sample_fmt(is->swr_ctx_audio, "out_sample_fmt", AV_SAMPLE_FMT_S16,  0);
+
+        /* initialize the resampling context */
+        if ((ret = swr_init(is->swr_ctx_audio)) < 0) {
+            fprintf(stderr, "Failed to initialize the resampling context\n");
+            av_channel_layout_uninit(&ch_layout);
+            return -1;
+        }
+        is->audio_src_fmt = (enum AVSampleFormat)decoded_frame->format;
+        av_channel_layout_uninit(&is->audio_src_ch_layout);
+        is->audio_src_ch_layout = ch_layout;
+        is->audio_src_freq = decoded_frame->sample_rate;
+    } else {
+        av_channel_layout_uninit(&ch_layout);
     }
 
-    /* compute destination number of samples */
-    dst_nb_samples = av_rescale_rnd(swr_get_delay(is->swr_ctx_audio, src_rate) + src_nb_samples, dst_rate, src_rate, AV_ROUND_UP);
+    /* rates are equal, so audio_buf holds far more than one frame */
+    out_count = sizeof(is->audio_buf) / (nb_channels * av_get_bytes_per_sample(AV_SAMPLE_FMT_S16));
 
     /* convert to destination format */
-    ret = swr_convert(is->swr_ctx_audio, dst_data, dst_nb_samples, (const uint8_t **)decoded_frame.data, src_nb_samples);
+    ret = swr_convert(is->swr_ctx_audio, out, out_count,
+                      (const uint8_t **)decoded_frame->extended_data,
+                      decoded_frame->nb_samples);
     if (ret < 0) {
         fprintf(stderr, "Error while converting\n");
         return -1;
     }
 
-    dst_bufsize = av_samples_get_buffer_size(decoded_frame.linesize, dst_nb_channels, ret, dst_sample_fmt, 1);
-    if (dst_bufsize < 0) {
-        fprintf(stderr, "Could not get sample buffer size\n");
-        return -1;
-    }
-
-    memcpy(is->audio_buf, dst_data[0], dst_bufsize);
-
-    if (src_data) {
-        av_freep(&src_data[0]);
-    }
-    av_freep(&src_data);
-
-    if (dst_data) {
-        av_freep(&dst_data[0]);
-    }
-    av_freep(&dst_data);
-
-    return dst_bufsize;
+    return ret * nb_channels * av_get_bytes_per_sample(AV_SAMPLE_FMT_S16);
 }
 
 int audio_decode_frame(VideoState *is, double *pts_ptr) {
 
-  int len1, data_size = 0, n;
+  int ret, data_size = 0, n, serial;
   AVPacket *pkt = &is->audio_pkt;
   double pts;
 
   for(;;) {
-    while(is->audio_pkt_size > 0) {
-      int got_frame = 0;
-      //len1 = avcodec_decode_audio4(is->audio_st->codecpar, &is->audio_frame, &got_frame, pkt);
-      len1 = avcodec_send_packet(is->audio_codec_ctx,pkt);
-      if(len1 < 0)
-      {
-        /* if error, skip frame */
-        is->audio_pkt_size = 0;
-        break;
-      }
-       len1 = avcodec_receive_frame(is->audio_codec_ctx,&is->audio_frame);
-
+    ret = avcodec_receive_frame(is->audio_codec_ctx, &is->audio_frame);
+    if(ret == 0 && is->audio_pkt_serial != is->audioq.serial) {
+      /* decoded from before the last seek */
+      av_frame_unref(&is->audio_frame);
+      continue;
+    }
+    if(ret == 0 && is->audio_pkt_serial == is->audio_seek_target_serial &&
+       is->audio_frame.sample_rate > 0 &&
+       is->audio_clock + (double)is->audio_frame.nb_samples /
+       is->audio_frame.sample_rate <= is->seek_target) {
+      /* wholly before an exact seek target: not converted, not played */
+      is->audio_clock += (double)is->audio_frame.nb_samples /
+    is->audio_frame.sample_rate;
+      av_frame_unref(&is->audio_frame);
+      continue;
+    }
+    if(ret == 0) {
       if (is->audio_frame.format != AV_SAMPLE_FMT_S16) {
-          data_size = decode_frame_from_packet(is, is->audio_frame);
+          data_size = decode_frame_from_packet(is, &is->audio_frame);
       } else
       {
         data_size =av_samples_get_buffer_size
           ( NULL,
-            is->audio_frame.channels,
+            is->audio_frame.ch_layout.nb_channels,
             is->audio_frame.nb_samples,
             (enum AVSampleFormat)is->audio_frame.format,
             1);
         memcpy(is->audio_buf, is->audio_frame.data[0], data_size);
       }
-
-      is->audio_pkt_data += len1;
-      is->audio_pkt_size -= len1;
       if(data_size <= 0) {
     /* No data yet, get more frames */
     continue;
       }
       pts = is->audio_clock;
+      n = 2 * is->audio_st->codecpar->ch_layout.nb_channels;
+      if(is->audio_pkt_serial == is->audio_seek_target_serial &&
+         pts < is->seek_target) {
+    /* straddles the target: start playing right at it */
+    int skip = (int)((is->seek_target - pts) *
+                     is->audio_st->codecpar->sample_rate) * n;
+    if(skip > 0 && skip < data_size) {
+      memmove(is->audio_buf, is->audio_buf + skip, data_size - skip);
+      data_size -= skip;
+      pts += (double)skip / (double)(n * is->audio_st->codecpar->sample_rate);
+    }
+      }
       *pts_ptr = pts;
-      n = 2 * is->audio_st->codecpar->channels;
-      is->audio_clock += (double)data_size /
+      is->audio_clock = pts + (double)data_size /
     (double)(n * is->audio_st->codecpar->sample_rate);
 
       /* We have data, return it and come back for more later */
       return data_size;
     }
-    if(pkt->data)
-      av_packet_unref(pkt);
 
     if(is->quit) {
       return -1;
     }
     /* next packet */
-    if(packet_queue_get(&is->audioq, pkt, 1) < 0) {
+    if(packet_queue_get(&is->audioq, pkt, 1, &serial) < 0) {
       return -1;
     }
-    if(pkt->data == flush_pkt.data) {
+    if(serial != is->audio_pkt_serial) {
+      /* first packet after a seek */
       avcodec_flush_buffers(is->audio_codec_ctx);
+      audio_ring_flush(&is->audio_ring);
+      is->audio_pkt_serial = serial;
+    }
+    if(serial != is->audioq.serial) {
+      av_packet_unref(pkt);
       continue;
     }
-    is->audio_pkt_data = pkt->data;
-    is->audio_pkt_size = pkt->size;
     /* if update, update the audio clock w/pts */
     if(pkt->pts != AV_NOPTS_VALUE) {
       is->audio_clock = av_q2d(is->audio_st->time_base)*pkt->pts;
     }
+    /* if error, skip packet; the decoder keeps its own reference */
+    avcodec_send_packet(is->audio_codec_ctx, pkt);
+    av_packet_unref(pkt);
   }
 }
 
+/* Runs on SDL's audio thread: only copies from the ring, never decodes. */
 void audio_callback(void *userdata, Uint8 *stream, int len) {
 
   VideoState *is = (VideoState *)userdata;
-  int len1, audio_size;
+  int len1;
+
+  len1 = audio_ring_read(&is->audio_ring, stream, len);
+  if(len1 < len) {
+    /* audio_thread fell behind, output silence */
+    memset(stream + len1, 0, len - len1);
+    if(is->audio_ring.windex.load())
+      is->audio_ring.underruns++;
+  }
+}
+
+int audio_thread(void *arg) {
+  VideoState *is = (VideoState *)arg;
+  int audio_size;
   double pts;
 
-  while(len > 0) {
-    if(is->audio_buf_index >= is->audio_buf_size) {
-      /* We have already sent all our data; get more */
-      audio_size = audio_decode_frame(is, &pts);
-      if(audio_size < 0) {
-    /* If error, output silence */
-    is->audio_buf_size = 1024;
-    memset(is->audio_buf, 0, is->audio_buf_size);
-      } else {
+  for(;;) {
+    audio_size = audio_decode_frame(is, &pts);
+    if(audio_size < 0) {
+      // means we quit getting packets
+      break;
+    }
     audio_size = synchronize_audio(is, (int16_t *)is->audio_buf,
-                       audio_size, pts);
-    is->audio_buf_size = audio_size;
-      }
-      is->audio_buf_index = 0;
+                                   audio_size, pts);
+    if(audio_ring_write(&is->audio_ring, is->audio_buf, audio_size) < 0) {
+      break;
     }
-    len1 = is->audio_buf_size - is->audio_buf_index;
-    if(len1 > len)
-      len1 = len;
-    memcpy(stream, (uint8_t *)is->audio_buf + is->audio_buf_index, len1);
-    len -= len1;
-    stream += len1;
-    is->audio_buf_index += len1;
+    /* only now is the data counted in the ring fill */
+    is->audio_ring_clock = pts + (double)audio_size / is->audio_ring.bytes_per_sec;
   }
+  return 0;
 }
 
-static Uint32 sdl_refresh_timer_cb(Uint32 interval, void *opaque) {
+/* Have the main thread look at the picture queue again. Safe from any
+   thread; wakes go out as one FF_REFRESH_EVENT until that is handled. */
+static void present_wake(VideoState *is) {
   SDL_Event event;
+
+  if(is->refresh_pending.exchange(1))
+    return;
   event.type = FF_REFRESH_EVENT;
-  event.user.data1 = opaque;
+  event.user.data1 = is;
   SDL_PushEvent(&event);
-  return 0; /* 0 means stop timer */
 }
 
-/* schedule a video refresh in 'delay' ms */
-static void schedule_refresh(VideoState *is, int delay) {
-  SDL_AddTimer(delay, sdl_refresh_timer_cb, is);
+/* Where a width x height picture goes in a window_w x window_h window,
+   letterboxed to its display aspect ratio. Goes by the picture rather
+   than the stream, whose parameters are stale after a mid-stream
+   resolution change. */
+static void calculate_display_rect(int width, int height, AVRational sar,
+                                   int window_w, int window_h, SDL_Rect *rect) {
+  float aspect_ratio;
+  int w, h;
+
+  if(sar.num == 0) {
+    aspect_ratio = 0;
+  } else {
+    aspect_ratio = av_q2d(sar) * width / height;
+  }
+  if(aspect_ratio <= 0.0) {
+    aspect_ratio = (float)width / (float)height;
+  }
+
+  h = window_h;
+  w = ((int)rint(h * aspect_ratio)) & -3;
+  if(w > window_w) {
+    w = window_w;
+    h = ((int)rint(w / aspect_ratio)) & -3;
+  }
+  rect->x = (window_w - w) / 2;
+  rect->y = (window_h - h) / 2;
+  rect->w = w;
+  rect->h = h;
 }
 
+static void picture_upload(VideoState *is, VideoPicture *vp);
+
 void video_display(VideoState *is) {
 
   SDL_Rect rect;
   VideoPicture *vp;
   //AVPicture pict;
-  float aspect_ratio;
-  int w, h, x, y;
-  //int i;
 
   vp = &is->pictq[is->pictq_rindex];
+  picture_upload(is, vp);
   if(vp->texture) {
-    if(is->video_st->codecpar->sample_aspect_ratio.num == 0) {
-      aspect_ratio = 0;
-    } else {
-      aspect_ratio = av_q2d(is->video_st->codecpar->sample_aspect_ratio) *
-    is->video_st->codecpar->width / is->video_st->codecpar->height;
-    }
-    if(aspect_ratio <= 0.0) {
-      aspect_ratio = (float)is->video_st->codecpar->width /
-    (float)is->video_st->codecpar->height;
-    }
+    calculate_display_rect(vp->frame_width, vp->frame_height, vp->sar,
+                           is->window_w, is->window_h, &rect);
+    SDL_RenderClear(is->renderer);
 
-    //获取窗口的大小
-    int window_w,window_h;
-    SDL_GetWindowSize(window,&window_w,&window_h);
-    h = window_h;
-    w = ((int)rint(h * aspect_ratio)) & -3;
-    if(w > window_w) {
-      w = window_w;
-      h = ((int)rint(w / aspect_ratio)) & -3;
-    }
-    x = (window_w - w) / 2;
-    y = (window_h - h) / 2;
+    SDL_RenderCopy(is->renderer,vp->texture,NULL,&rect);
 
-    rect.x = x;
-    rect.y = y;
-    rect.w = w;
-    rect.h = h;
-    SDL_RenderClear(vp->render);
+    SDL_RenderPresent(is->renderer);
 
-    SDL_RenderCopy(vp->render,vp->texture,NULL,&rect);
+  }
+}
 
-    SDL_RenderPresent(vp->render);
+static void pictq_next(VideoState *is) {
+  VideoPicture *vp = &is->pictq[is->pictq_rindex];
 
+  /* hand the decoder its buffer back before the slot */
+  av_frame_unref(vp->frame);
+  vp->upload = 0;
+  if(++is->pictq_rindex == is->pictq_depth) {
+    is->pictq_rindex = 0;
   }
+  SDL_LockMutex(is->pictq_mutex);
+  is->pictq_size--;
+  SDL_CondSignal(is->pictq_cond);
+  SDL_UnlockMutex(is->pictq_mutex);
 }
 
-void video_refresh_timer(void *userdata) {
+/* Show the picture that is due, if any. Returns how long to wait
+   before the next one in seconds, negative to wait until woken up
+   (paused, or nothing decoded yet). */
+static double video_refresh(VideoState *is) {
 
-  VideoState *is = (VideoState *)userdata;
   VideoPicture *vp;
   double actual_delay, delay, sync_threshold, ref_clock, diff;
+  int late;
 
-  if(is->video_st) {
+  if(is->paused || !is->video_st)
+    return -1;
+  retry:
     if(is->pictq_size == 0) {
-      schedule_refresh(is, 1);
+      return -1;
     } else {
       vp = &is->pictq[is->pictq_rindex];
 
+      if(vp->serial != is->videoq.serial) {
+    /* decoded before the last seek, never show it */
+    pictq_next(is);
+    goto retry;
+      }
+      if(vp->serial != is->video_current_serial) {
+    /* first picture after a seek: restart the frame timer */
+    int64_t seek_start = is->seek_start_time.exchange(0);
+    is->video_current_serial = vp->serial;
+    is->frame_timer = av_gettime() / 1000000.0;
+    is->frame_last_pts = vp->pts;
+    if(seek_start) {
+      fprintf(stderr, "%s: %s seek to %.3f s shows %.3f s after %.1f ms, "
+              "%d frames decoded and dropped\n", is->filename,
+              is->seek_exact ? "exact" : "keyframe", is->seek_target.load(), vp->pts,
+              (av_gettime_relative() - seek_start) / 1000.0,
+              is->frames_preroll - is->seek_start_preroll);
+    }
+      }
+
       is->video_current_pts = vp->pts;
       is->video_current_pts_time = av_gettime();
 
@@ -602,6 +1055,7 @@ void video_refresh_timer(void *userdata) {
       is->frame_last_pts = vp->pts;
 
       /* update delay to sync to audio if not master source */
+      late = 0;
       if(is->av_sync_type != AV_SYNC_VIDEO_MASTER) {
     ref_clock = get_master_clock(is);
     diff = vp->pts - ref_clock;
@@ -612,6 +1066,7 @@ void video_refresh_timer(void *userdata) {
     if(fabs(diff) < AV_NOSYNC_THRESHOLD) {
       if(diff <= -sync_threshold) {
         delay = 0;
+        late = 1;
       } else if(diff >= sync_threshold) {
         delay = 2 * delay;
       }
@@ -619,256 +1074,989 @@ void video_refresh_timer(void *userdata) {
       }
 
       is->frame_timer += delay;
+      is->video_schedule = is->frame_timer - vp->pts;
       /* computer the REAL delay */
       actual_delay = is->frame_timer - (av_gettime() / 1000000.0);
+      if(actual_delay < 0) {
+    late = 1;
+      }
+      if(late && framedrop && is->pictq_size > 1) {
+    /* already behind the clock and a newer picture is decoded:
+       skip this one rather than show it late */
+    is->frames_dropped++;
+    pictq_next(is);
+    goto retry;
+      }
+      if(late) {
+    is->frames_late++;
+      }
       if(actual_delay < 0.010) {
-    /* Really it should skip the picture instead */
     actual_delay = 0.010;
       }
-      schedule_refresh(is, (int)(actual_delay * 1000 + 0.5));
 
       /* show the picture! */
       video_display(is);
+      if(is->frames_displayed == 0) {
+    fprintf(stderr, "%s: first frame after %.1f ms, streams %s after %.1f ms\n",
+            is->filename, (av_gettime_relative() - is->open_time) / 1000.0,
+            is->probe_cached ? "from the probe cache" : "probed",
+            is->probe_time / 1000.0);
+      }
+      is->frames_displayed++;
 
       /* update queue for next picture! */
-      if(++is->pictq_rindex == VIDEO_PICTURE_QUEUE_SIZE) {
-    is->pictq_rindex = 0;
-      }
-      SDL_LockMutex(is->pictq_mutex);
-      is->pictq_size--;
-      SDL_CondSignal(is->pictq_cond);
-      SDL_UnlockMutex(is->pictq_mutex);
+      pictq_next(is);
+      return actual_delay;
     }
-  } else {
-    schedule_refresh(is, 100);
+}
+
+/* Main thread: the renderer, like the window, belongs to it. With
+   vsync on SDL_RenderPresent lines the flip up with the display's
+   refresh instead of tearing mid-scan. */
+static int video_open_renderer(VideoState *is) {
+  Uint32 flags = SDL_RENDERER_ACCELERATED;
+
+  if(vsync)
+    flags |= SDL_RENDERER_PRESENTVSYNC;
+  is->renderer = SDL_CreateRenderer(is->window, -1, flags);
+  if(!is->renderer) {
+    /* take whatever there is, software included */
+    is->renderer = SDL_CreateRenderer(is->window, -1, 0);
+  }
+  if(!is->renderer) {
+    fprintf(stderr, "SDL: could not create renderer - %s\n", SDL_GetError());
+    return -1;
+  }
+  SDL_SetRenderDrawColor(is->renderer, 0, 0, 0, 255);
+  if(SDL_GetRendererInfo(is->renderer, &is->renderer_info) < 0) {
+    /* no list means everything goes through sws_scale */
+    is->renderer_info.num_texture_formats = 0;
   }
+  return 0;
 }
 
-void alloc_picture(void *userdata) {
+static void video_close_renderer(VideoState *is) {
+  int i;
 
-  VideoState *is = (VideoState *)userdata;
-  VideoPicture *vp;
+  for(i = 0; i < VIDEO_PICTURE_QUEUE_MAX; i++) {
+    if(is->pictq[i].texture) {
+      SDL_DestroyTexture(is->pictq[i].texture);
+      is->pictq[i].texture = NULL;
+    }
+  }
+  if(is->renderer)
+    SDL_DestroyRenderer(is->renderer);
+  is->renderer = NULL;
+}
 
-  vp = &is->pictq[is->pictq_windex];
-  if(vp->texture) {
-    // we already have one make another, bigger/smaller
-    //SDL_FreeYUVOverlay(vp->bmp);
-      SDL_DestroyTexture(vp->texture);
+void alloc_pictures(VideoState *is);
+
+/* Main thread: run video_refresh for a player woken by present_wake or
+   whose next picture is due, and note when to come back. The event
+   loop sleeps until then in SDL_WaitEventTimeout, so nothing here ever
+   blocks the other players or the window. */
+static void video_present(VideoState *is, int woken) {
+  int64_t left;
+  double delay;
+
+  if(woken) {
+    /* new pictures that arrive while one is scheduled wait their turn */
+    is->refresh_pending = 0;
+    if(is->present_due >= 0)
+      return;
+  } else {
+    if(is->present_due < 0)
+      return;
+    left = is->present_due - av_gettime_relative();
+    if(left > PRESENT_EARLY_US)
+      return;
+  }
+  if(is->prealloc_pending.exchange(0)) {
+    alloc_pictures(is);
   }
-  // Allocate a place to put our YUV image on that screen
-  vp->texture = SDL_CreateTexture(vp->render,
-                                  SDL_PIXELFORMAT_YV12,
-                                  SDL_TEXTUREACCESS_STREAMING,
-                                  is->video_st->codecpar->width,
-                                  is->video_st->codecpar->height);
-  vp->width = is->video_st->codecpar->width;
-  vp->height = is->video_st->codecpar->height;
+  delay = video_refresh(is);
+  is->present_due = delay < 0 ? -1 :
+                    av_gettime_relative() + (int64_t)(delay * 1000000.0);
+}
 
-  SDL_LockMutex(is->pictq_mutex);
-  vp->allocated = 1;
-  SDL_CondSignal(is->pictq_cond);
-  SDL_UnlockMutex(is->pictq_mutex);
+/* How long the main loop may wait for events before a player has a
+   picture due, in ms; -1 for as long as it likes. */
+static int video_present_timeout(VideoState **players, int nb_players) {
+  int64_t now = av_gettime_relative(), left, min_left = -1;
+  int i;
+
+  for(i = 0; i < nb_players; i++) {
+    if(players[i]->present_due < 0)
+      continue;
+    left = FFMAX(players[i]->present_due - now, 0);
+    if(min_left < 0 || left < min_left)
+      min_left = left;
+  }
+  /* to the nearest ms: anything woken up to PRESENT_EARLY_US early goes */
+  return min_left < 0 ? -1 : (int)((min_left + PRESENT_EARLY_US) / 1000);
+}
+
+static int scale_slice(ScaleWorker *w) {
+  ScalePool *pool = w->pool;
+  int ret;
 
+  if(w->slice_height <= 0)
+    return 0;
+  ret = sws_frame_start(w->sws_ctx, pool->dst, pool->src);
+  if(ret >= 0)
+    ret = sws_send_slice(w->sws_ctx, 0, pool->src->height);
+  if(ret >= 0)
+    ret = sws_receive_slice(w->sws_ctx, w->slice_start, w->slice_height);
+  sws_frame_end(w->sws_ctx);
+  return ret;
 }
 
-int queue_picture(VideoState *is, AVFrame *pFrame, double pts) {
+static int scale_worker_thread(void *arg) {
+  ScaleWorker *w = (ScaleWorker *)arg;
+  ScalePool *pool = w->pool;
+  int job = 0;
 
-  VideoPicture *vp;
-  //int dst_pix_fmt;
-  //AVPicture pict;
-  AVFrame pict;
+  SDL_LockMutex(pool->mutex);
+  for(;;) {
+    while(pool->job == job && !pool->quit)
+      SDL_CondWait(pool->work_cond, pool->mutex);
+    if(pool->quit)
+      break;
+    job = pool->job;
+    SDL_UnlockMutex(pool->mutex);
 
-  /* wait until we have space for a new pic */
-  SDL_LockMutex(is->pictq_mutex);
-  while(is->pictq_size >= VIDEO_PICTURE_QUEUE_SIZE &&
-    !is->quit) {
-    SDL_CondWait(is->pictq_cond, is->pictq_mutex);
+    w->ret = scale_slice(w);
+
+    SDL_LockMutex(pool->mutex);
+    if(--pool->pending == 0)
+      SDL_CondSignal(pool->done_cond);
   }
-  SDL_UnlockMutex(is->pictq_mutex);
+  SDL_UnlockMutex(pool->mutex);
+  return 0;
+}
 
-  if(is->quit)
-    return -1;
+/* Enough workers that each gets roughly a 720p worth of rows. */
+static int scale_pool_workers(int width, int height) {
+  int n = scale_threads;
 
-  // windex is set to 0 initially
-  vp = &is->pictq[is->pictq_windex];
+  if(n <= 0)
+    n = (width * height) / (1280 * 720);
+  return av_clip(n, 1, FFMIN(SDL_GetCPUCount(), MAX_SCALE_THREADS));
+}
 
-  /* allocate or resize the buffer! */
-  if(!vp->texture ||
-     vp->width != is->video_st->codecpar->width ||
-     vp->height != is->video_st->codecpar->height) {
-    SDL_Event event;
+/* The worker contexts are built on first use, see scale_pool_configure. */
+static int scale_pool_init(ScalePool *pool, int width, int height) {
+  int i;
 
-    vp->allocated = 0;
-    /* we have to do it in the main thread */
-    event.type = FF_ALLOC_EVENT;
-    event.user.data1 = is;
-    SDL_PushEvent(&event);
+  pool->nb_workers = scale_pool_workers(width, height);
+  for(i = 0; i < SCALE_CACHE_SIZE; i++)
+    pool->cache[i].src_fmt = pool->cache[i].dst_fmt = AV_PIX_FMT_NONE;
+  pool->mutex = SDL_CreateMutex();
+  pool->work_cond = SDL_CreateCond();
+  pool->done_cond = SDL_CreateCond();
+  pool->dst = av_frame_alloc();
+  if(!pool->mutex || !pool->work_cond || !pool->done_cond || !pool->dst)
+    return -1;
+  for(i = 0; i < pool->nb_workers; i++) {
+    ScaleWorker *w = &pool->workers[i];
 
-    /* wait until we have a picture allocated */
-    SDL_LockMutex(is->pictq_mutex);
-    while(!vp->allocated && !is->quit) {
-      SDL_CondWait(is->pictq_cond, is->pictq_mutex);
-    }
-    SDL_UnlockMutex(is->pictq_mutex);
-    if(is->quit) {
-      return -1;
-    }
+    w->pool = pool;
+    if(i > 0)
+      w->tid = SDL_CreateThread(scale_worker_thread, "scale_worker", w);
   }
-  /* We have a place to put our picture on the queue */
-  /* If we are skipping a frame, do we set this to null
-     but still return vp->allocated = 1? */
+  return 0;
+}
 
+/* Point the workers at the contexts for this geometry, building them
+   in place of the least recently used set on a miss. Called from the
+   converting thread between jobs only. */
+static int scale_pool_configure(ScalePool *pool,
+                                int src_w, int src_h, enum AVPixelFormat src_fmt,
+                                int dst_w, int dst_h, enum AVPixelFormat dst_fmt) {
+  ScaleContexts *sc = NULL, *lru = &pool->cache[0];
+  int i;
 
-  if(vp->texture) {
-      int pitch;
-      uint8_t* pixels;
-      SDL_LockTexture(vp->texture,NULL,(void **)&pixels,&pitch);
-
-    //SDL_LockYUVOverlay(vp->bmp);
-
-    //dst_pix_fmt = PIX_FMT_YUV420P;
-    /* point pict at the queue */
-
-    pict.data[0] = pixels;
-    pict.data[1] = pixels + vp->width;
-    pict.data[2] = pixels + vp->width + vp->width/4;
-
-    pict.linesize[0] = pitch;
-    pict.linesize[1] = pitch / 2;
-    pict.linesize[2] = pitch / 2;
-
-    // Convert the image into YUV format that SDL uses
-    sws_scale
-    (
-        is->sws_ctx,
-        (uint8_t const * const *)pFrame->data,
-        pFrame->linesize,
-        0,
-        is->video_st->codecpar->height,
-        pict.data,
-        pict.linesize
-    );
-
-    SDL_UnlockTexture(vp->texture);
-    //SDL_UnlockYUVOverlay(vp->bmp);
-    vp->pts = pts;
-
-    /* now we inform our display thread that we have a pic ready */
-    if(++is->pictq_windex == VIDEO_PICTURE_QUEUE_SIZE) {
-      is->pictq_windex = 0;
-    }
-    SDL_LockMutex(is->pictq_mutex);
-    is->pictq_size++;
-    SDL_UnlockMutex(is->pictq_mutex);
+  for(i = 0; i < SCALE_CACHE_SIZE; i++) {
+    ScaleContexts *c = &pool->cache[i];
+    if(c->src_w == src_w && c->src_h == src_h && c->src_fmt == src_fmt &&
+       c->dst_w == dst_w && c->dst_h == dst_h && c->dst_fmt == dst_fmt) {
+      sc = c;
+      break;
+    }
+    if(c->last_used < lru->last_used)
+      lru = c;
   }
+  if(!sc) {
+    sc = lru;
+    sc->src_fmt = sc->dst_fmt = AV_PIX_FMT_NONE;
+    for(i = 0; i < pool->nb_workers; i++) {
+      sc->sws_ctx[i] = sws_getCachedContext(sc->sws_ctx[i],
+                                            src_w, src_h, src_fmt,
+                                            dst_w, dst_h, dst_fmt,
+                                            SWS_BILINEAR, NULL, NULL, NULL);
+      if(!sc->sws_ctx[i])
+        return -1;
+    }
+    sc->src_w = src_w;
+    sc->src_h = src_h;
+    sc->src_fmt = src_fmt;
+    sc->dst_w = dst_w;
+    sc->dst_h = dst_h;
+    sc->dst_fmt = dst_fmt;
+    pool->nb_builds++;
+  }
+  sc->last_used = ++pool->uses;
+  for(i = 0; i < pool->nb_workers; i++)
+    pool->workers[i].sws_ctx = sc->sws_ctx[i];
   return 0;
 }
 
-double synchronize_video(VideoState *is, AVFrame *src_frame, double pts) {
-
-  double frame_delay;
+static void scale_pool_destroy(ScalePool *pool) {
+  int i;
 
-  if(pts != 0) {
-    /* if we have pts, set video clock to it */
-    is->video_clock = pts;
-  } else {
-    /* if we aren't given a pts, set it to the clock */
-    pts = is->video_clock;
+  if(pool->mutex) {
+    SDL_LockMutex(pool->mutex);
+    pool->quit = 1;
+    SDL_CondBroadcast(pool->work_cond);
+    SDL_UnlockMutex(pool->mutex);
   }
-  /* update the video clock */
-  frame_delay = av_q2d(is->video_st->time_base);
-  /* if we are repeating a frame, adjust clock accordingly */
-  frame_delay += src_frame->repeat_pict * (frame_delay * 0.5);
-  is->video_clock += frame_delay;
-  return pts;
+  for(i = 0; i < pool->nb_workers; i++)
+    SDL_WaitThread(pool->workers[i].tid, NULL);
+  for(i = 0; i < SCALE_CACHE_SIZE; i++) {
+    for(int j = 0; j < pool->nb_workers; j++)
+      sws_freeContext(pool->cache[i].sws_ctx[j]);
+  }
+  av_frame_free(&pool->dst);
+  SDL_DestroyCond(pool->work_cond);
+  SDL_DestroyCond(pool->done_cond);
+  SDL_DestroyMutex(pool->mutex);
 }
 
-uint64_t global_video_pkt_pts = AV_NOPTS_VALUE;
-
-/* These are called whenever we allocate a frame
- * buffer. We use this to store the global_pts in
- * a frame at the time it is allocated.
- */
-int our_get_buffer(struct AVCodecContext *c, AVFrame *pic,int flags) {
-  int ret = avcodec_default_get_buffer2(c, pic,0);
-  uint64_t *pts = (uint64_t*)av_malloc(sizeof(uint64_t));
-  *pts = global_video_pkt_pts;
-  pic->opaque = pts;
-  return ret;
-}
-void our_release_buffer(struct AVCodecContext *c, AVFrame *pic) {
-  if(pic) av_freep(&pic->opaque);
-  av_frame_unref(pic);
+static void scale_pool_dst_free(void *, uint8_t *) {
+  /* the pixels belong to the texture */
 }
 
-int video_thread(void *arg) {
-  VideoState *is = (VideoState *)arg;
-  AVPacket pkt1, *packet = &pkt1;
-  int frameFinished;
-  AVFrame *pFrame;
+/* Convert src into the planes at dst_data, spreading the rows over the
+   workers. Returns once every slice is done. */
+static int scale_pool_run(ScalePool *pool, AVFrame *src,
+                          enum AVPixelFormat dst_fmt, int dst_w, int dst_h,
+                          uint8_t *dst_data[4], int dst_linesize[4],
+                          size_t dst_size) {
+  int64_t align;
+  int slice_h, i, ret = 0;
+
+  if(scale_pool_configure(pool, src->width, src->height,
+                          (enum AVPixelFormat)src->format,
+                          dst_w, dst_h, dst_fmt) < 0)
+    return AVERROR(EINVAL);
+  av_frame_unref(pool->dst);
+  pool->dst->format = dst_fmt;
+  pool->dst->width = dst_w;
+  pool->dst->height = dst_h;
+  for(i = 0; i < 4; i++) {
+    pool->dst->data[i] = dst_data[i];
+    pool->dst->linesize[i] = dst_linesize[i];
+  }
+  /* sws_frame_start wants a refcounted frame */
+  pool->dst->buf[0] = av_buffer_create(dst_data[0], dst_size,
+                                       scale_pool_dst_free, NULL, 0);
+  if(!pool->dst->buf[0])
+    return AVERROR(ENOMEM);
+  pool->src = src;
+
+  /* some unscaled converters can only do the frame in one go */
+  align = sws_receive_slice_alignment(pool->workers[0].sws_ctx);
+  if(align <= 0 || align >= dst_h)
+    slice_h = dst_h;
+  else
+    slice_h = FFALIGN((dst_h + pool->nb_workers - 1) / pool->nb_workers, align);
+  for(i = 0; i < pool->nb_workers; i++) {
+    ScaleWorker *w = &pool->workers[i];
+    w->slice_start = FFMIN(i * slice_h, dst_h);
+    w->slice_height = FFMIN(slice_h, dst_h - w->slice_start);
+    w->ret = 0;
+  }
+
+  if(pool->nb_workers > 1) {
+    SDL_LockMutex(pool->mutex);
+    pool->pending = pool->nb_workers - 1;
+    pool->job++;
+    SDL_CondBroadcast(pool->work_cond);
+    SDL_UnlockMutex(pool->mutex);
+  }
+  pool->workers[0].ret = scale_slice(&pool->workers[0]);
+  if(pool->nb_workers > 1) {
+    SDL_LockMutex(pool->mutex);
+    while(pool->pending > 0)
+      SDL_CondWait(pool->done_cond, pool->mutex);
+    SDL_UnlockMutex(pool->mutex);
+  }
+
+  for(i = 0; i < pool->nb_workers; i++) {
+    if(pool->workers[i].ret < 0)
+      ret = pool->workers[i].ret;
+  }
+  pool->src = NULL;
+  av_frame_unref(pool->dst);
+  return ret;
+}
+
+/* Decoder output formats SDL can take without conversion.  Listed in
+   order of preference; the first one the renderer supports wins.
+   YUVJ420P is left out on purpose, sws_scale also squeezes it into
+   limited range for us. */
+static const struct TextureFormatEntry {
+  enum AVPixelFormat pix_fmt;
+  Uint32 texture_fmt;
+} texture_format_map[] = {
+  { AV_PIX_FMT_YUV420P, SDL_PIXELFORMAT_IYUV },
+  { AV_PIX_FMT_YUV420P, SDL_PIXELFORMAT_YV12 },
+  { AV_PIX_FMT_NV12,    SDL_PIXELFORMAT_NV12 },
+  { AV_PIX_FMT_NV21,    SDL_PIXELFORMAT_NV21 },
+  { AV_PIX_FMT_RGB32,   SDL_PIXELFORMAT_ARGB8888 },
+  { AV_PIX_FMT_BGR32,   SDL_PIXELFORMAT_ABGR8888 },
+  { AV_PIX_FMT_0RGB32,  SDL_PIXELFORMAT_RGB888 },
+  { AV_PIX_FMT_0BGR32,  SDL_PIXELFORMAT_BGR888 },
+  { AV_PIX_FMT_RGB24,   SDL_PIXELFORMAT_RGB24 },
+  { AV_PIX_FMT_BGR24,   SDL_PIXELFORMAT_BGR24 },
+  { AV_PIX_FMT_RGB565,  SDL_PIXELFORMAT_RGB565 },
+};
+
+static int renderer_supports(VideoState *is, Uint32 texture_fmt) {
+  for(Uint32 i = 0; i < is->renderer_info.num_texture_formats; i++) {
+    if(is->renderer_info.texture_formats[i] == texture_fmt)
+      return 1;
+  }
+  return 0;
+}
+
+/* Texture format the frame can be uploaded to as-is, or
+   SDL_PIXELFORMAT_UNKNOWN if it has to go through sws_scale. */
+static Uint32 texture_format_for(VideoState *is, int pix_fmt) {
+  for(size_t i = 0; i < FF_ARRAY_ELEMS(texture_format_map); i++) {
+    if(texture_format_map[i].pix_fmt == pix_fmt &&
+       renderer_supports(is, texture_format_map[i].texture_fmt))
+      return texture_format_map[i].texture_fmt;
+  }
+  return SDL_PIXELFORMAT_UNKNOWN;
+}
+
+static Uint32 direct_texture_format(VideoState *is, AVFrame *frame) {
+  /* SDL wants top-down planes */
+  for(int i = 0; i < AV_NUM_DATA_POINTERS && frame->data[i]; i++) {
+    if(frame->linesize[i] < 0)
+      return SDL_PIXELFORMAT_UNKNOWN;
+  }
+  return texture_format_for(is, frame->format);
+}
+
+static int upload_frame(VideoPicture *vp, AVFrame *frame) {
+  switch(vp->format) {
+  case SDL_PIXELFORMAT_IYUV:
+  case SDL_PIXELFORMAT_YV12:
+    /* SDL puts U and V where the texture layout wants them */
+    return SDL_UpdateYUVTexture(vp->texture, NULL,
+                                frame->data[0], frame->linesize[0],
+                                frame->data[1], frame->linesize[1],
+                                frame->data[2], frame->linesize[2]);
+  case SDL_PIXELFORMAT_NV12:
+  case SDL_PIXELFORMAT_NV21:
+    return SDL_UpdateNVTexture(vp->texture, NULL,
+                               frame->data[0], frame->linesize[0],
+                               frame->data[1], frame->linesize[1]);
+  default:
+    return SDL_UpdateTexture(vp->texture, NULL,
+                             frame->data[0], frame->linesize[0]);
+  }
+}
+
+/* Runs on the main thread, which owns the renderer and the textures.
+   Creates textures for the whole queue up front at the size and format
+   the stream was opened with, so that normally picture_upload finds one
+   ready in every slot. */
+void alloc_pictures(VideoState *is) {
+  int i;
+
+  for(i = 0; i < is->pictq_depth; i++) {
+    VideoPicture *vp = &is->pictq[i];
+
+    if(!vp->texture) {
+      vp->texture = SDL_CreateTexture(is->renderer,
+                                      is->prealloc_format,
+                                      SDL_TEXTUREACCESS_STREAMING,
+                                      is->prealloc_width,
+                                      is->prealloc_height);
+      if(!vp->texture) {
+        fprintf(stderr, "SDL: could not create texture - %s\n", SDL_GetError());
+      }
+      vp->texture_format = is->prealloc_format;
+      vp->texture_width = is->prealloc_width;
+      vp->texture_height = is->prealloc_height;
+    }
+  }
+}
+
+/* Called by video_display right before a picture is shown: (re)create
+   its texture if the picture no longer fits and upload the frame the
+   decoder queued. The texture is only ever touched here. */
+static void picture_upload(VideoState *is, VideoPicture *vp) {
+  int64_t start;
+
+  if(!vp->upload)
+    return;
+  start = av_gettime_relative();
+  if(!vp->texture || vp->texture_format != vp->format ||
+     vp->texture_width != vp->width || vp->texture_height != vp->height) {
+    if(vp->texture)
+      SDL_DestroyTexture(vp->texture);
+    vp->texture = SDL_CreateTexture(is->renderer, vp->format,
+                                    SDL_TEXTUREACCESS_STREAMING,
+                                    vp->width, vp->height);
+    if(!vp->texture) {
+      fprintf(stderr, "SDL: could not create texture - %s\n", SDL_GetError());
+    }
+    vp->texture_format = vp->format;
+    vp->texture_width = vp->width;
+    vp->texture_height = vp->height;
+  }
+  if(vp->texture && upload_frame(vp, vp->frame) < 0) {
+    fprintf(stderr, "SDL: texture upload failed - %s\n", SDL_GetError());
+  }
+  av_frame_unref(vp->frame);
+  vp->upload = 0;
+  is->upload_time += av_gettime_relative() - start;
+  is->frames_uploaded++;
+}
+
+/* Software renderers scale on the CPU anyway, and for a thumbnail even a
+   GPU would be fed mostly pixels it throws away: in those cases convert
+   straight to the size the picture is shown at. Accelerated renderers
+   at normal window sizes keep getting the full frame. */
+static int picture_target_size(VideoState *is, AVFrame *frame, AVRational sar,
+                               int *w, int *h) {
+  SDL_Rect rect;
+  int64_t src_area = (int64_t)frame->width * frame->height;
+
+  *w = frame->width;
+  *h = frame->height;
+  if(is->window_w <= 0 || is->window_h <= 0)
+    return 0;
+  calculate_display_rect(frame->width, frame->height, sar,
+                         is->window_w, is->window_h, &rect);
+  rect.w = FFMAX(rect.w & ~1, 2);
+  rect.h = FFMAX(rect.h & ~1, 2);
+  if(rect.w >= frame->width || rect.h >= frame->height)
+    return 0;
+  if(!(is->renderer_info.flags & SDL_RENDERER_SOFTWARE) &&
+     (int64_t)rect.w * rect.h * THUMBNAIL_RATIO > src_area)
+    return 0;
+  *w = rect.w;
+  *h = rect.h;
+  return 1;
+}
+
+/* Convert pFrame into width x height yuv420p planes. */
+static int convert_picture(VideoState *is, AVFrame *pFrame,
+                           uint8_t *data[4], int linesize[4], size_t size,
+                           int width, int height) {
+  convert_func convert = convert_find((enum AVPixelFormat)pFrame->format);
+  int64_t start = av_gettime_relative();
+  int ret = 0;
+
+  if(convert && pFrame->width == width && pFrame->height == height) {
+    /* the common decoder formats have a hand-written path */
+    convert(data, linesize, pFrame->data, pFrame->linesize, width, height);
+  } else {
+    ret = scale_pool_run(&is->scale_pool, pFrame, AV_PIX_FMT_YUV420P,
+                         width, height, data, linesize, size);
+  }
+  is->frames_converted++;
+  is->convert_time += av_gettime_relative() - start;
+  return ret;
+}
+
+/* Queue a picture for display. The decoder only ever produces frames
+   here: pictures SDL can take as they are are queued as a reference to
+   the decoded frame, anything else is converted into the slot's own
+   yuv420p frame first. Textures belong to the main thread, which uploads
+   in picture_upload right before showing the picture, so the decoder
+   never waits on a texture lock. */
+int queue_picture(VideoState *is, AVFrame *pFrame, double pts, int serial) {
+
+  VideoPicture *vp;
+  Uint32 direct_format, format;
+  int width, height, ret = 0;
+  AVRational sar;
+
+  /* the frame's own aspect ratio wins, the stream's is the fallback */
+  sar = av_guess_sample_aspect_ratio(is->pFormatCtx, is->video_st, pFrame);
+  direct_format = direct_texture_format(is, pFrame);
+  if(picture_target_size(is, pFrame, sar, &width, &height)) {
+    /* shrinking needs swscale */
+    direct_format = SDL_PIXELFORMAT_UNKNOWN;
+  }
+  format = direct_format != SDL_PIXELFORMAT_UNKNOWN ?
+           direct_format : (Uint32)SDL_PIXELFORMAT_YV12;
+
+  /* wait until we have space for a new pic */
+  SDL_LockMutex(is->pictq_mutex);
+  while(is->pictq_size >= is->pictq_depth &&
+    !is->quit) {
+    SDL_CondWait(is->pictq_cond, is->pictq_mutex);
+  }
+  SDL_UnlockMutex(is->pictq_mutex);
+
+  if(is->quit)
+    return -1;
+
+  // windex is set to 0 initially
+  vp = &is->pictq[is->pictq_windex];
+  av_frame_unref(vp->frame);
+  vp->format = format;
+  vp->width = width;
+  vp->height = height;
+
+  if(direct_format != SDL_PIXELFORMAT_UNKNOWN) {
+    /* decoder already hands us what the texture holds */
+    ret = av_frame_ref(vp->frame, pFrame);
+  } else {
+    AVFrame *conv = vp->convert_frame;
+
+    if(conv->width != width || conv->height != height) {
+      av_frame_unref(conv);
+      conv->format = AV_PIX_FMT_YUV420P;
+      conv->width = width;
+      conv->height = height;
+      ret = av_frame_get_buffer(conv, 0);
+    }
+    if(ret >= 0)
+      ret = convert_picture(is, pFrame, conv->data, conv->linesize,
+                            conv->buf[0]->size, width, height);
+    if(ret >= 0)
+      ret = av_frame_ref(vp->frame, conv);
+  }
+  if(ret < 0) {
+    fprintf(stderr, "%s: could not queue a picture\n", is->filename);
+    return 0;
+  }
+  vp->upload = 1;
+  vp->pts = pts;
+  vp->serial = serial;
+  vp->frame_width = pFrame->width;
+  vp->frame_height = pFrame->height;
+  vp->sar = sar;
+
+  /* now we inform our display thread that we have a pic ready */
+  if(++is->pictq_windex == is->pictq_depth) {
+    is->pictq_windex = 0;
+  }
+  SDL_LockMutex(is->pictq_mutex);
+  is->pictq_size++;
+  SDL_UnlockMutex(is->pictq_mutex);
+  present_wake(is);
+  return 0;
+}
+
+double synchronize_video(VideoState *is, AVFrame *src_frame, double pts) {
+
+  double frame_delay;
+
+  if(pts != 0) {
+    /* if we have pts, set video clock to it */
+    is->video_clock = pts;
+  } else {
+    /* if we aren't given a pts, set it to the clock */
+    pts = is->video_clock;
+  }
+  /* update the video clock */
+  frame_delay = av_q2d(is->video_st->time_base);
+  /* if we are repeating a frame, adjust clock accordingly */
+  frame_delay += src_frame->repeat_pict * (frame_delay * 0.5);
+  is->video_clock += frame_delay;
+  return pts;
+}
+
+/* Pool buffers are at least page aligned, and the big ones are huge
+   page aligned so the kernel can back a 4K plane with a few TLB
+   entries instead of hundreds. */
+static void frame_pool_free(void *, uint8_t *data) {
+#ifdef _WIN32
+  _aligned_free(data);
+#else
+  free(data);
+#endif
+}
+
+static AVBufferRef *frame_pool_alloc(void *, size_t size) {
+  size_t align = size >= FRAME_POOL_HUGE_PAGE ? FRAME_POOL_HUGE_PAGE : 4096;
+  uint8_t *data;
+  AVBufferRef *buf;
+
+  size = FFALIGN(size, align);
+#ifdef _WIN32
+  data = (uint8_t *)_aligned_malloc(size, align);
+#else
+  if(posix_memalign((void **)&data, align, size))
+    data = NULL;
+#endif
+  if(!data)
+    return NULL;
+#if defined(__linux__) && defined(MADV_HUGEPAGE)
+  if(align == FRAME_POOL_HUGE_PAGE)
+    madvise(data, size, MADV_HUGEPAGE);
+#endif
+  buf = av_buffer_create(data, size, frame_pool_free, NULL, 0);
+  if(!buf)
+    frame_pool_free(NULL, data);
+  return buf;
+}
+
+static void frame_pool_uninit(FramePool *fp) {
+  for(int i = 0; i < 4; i++)
+    av_buffer_pool_uninit(&fp->pools[i]);
+  fp->format = AV_PIX_FMT_NONE;
+}
+
+/* Called with fp->mutex held. Same layout rules as libavcodec's own
+   pool: the width is padded until every linesize is aligned, so the
+   chroma strides stay in proportion to the luma one. */
+static int frame_pool_update(FramePool *fp, AVCodecContext *c, AVFrame *pic) {
+  int w = pic->width, h = pic->height;
+  int linesize_align[AV_NUM_DATA_POINTERS];
+  ptrdiff_t linesize[4];
+  size_t sizes[4];
+  int unaligned, i;
+
+  if(fp->format == pic->format && fp->width == pic->width &&
+     fp->height == pic->height)
+    return 0;
+  frame_pool_uninit(fp);
+
+  avcodec_align_dimensions2(c, &w, &h, linesize_align);
+  do {
+    if(av_image_fill_linesizes(fp->linesize, (enum AVPixelFormat)pic->format, w) < 0)
+      return -1;
+    w += w & ~(w - 1);
+    unaligned = 0;
+    for(i = 0; i < 4; i++)
+      unaligned |= fp->linesize[i] % FFMAX(linesize_align[i], FRAME_POOL_ALIGN);
+  } while(unaligned);
+
+  for(i = 0; i < 4; i++)
+    linesize[i] = fp->linesize[i];
+  if(av_image_fill_plane_sizes(sizes, (enum AVPixelFormat)pic->format, h, linesize) < 0)
+    return -1;
+  for(i = 0; i < 4 && sizes[i]; i++) {
+    /* decoders may read a little past the last line */
+    fp->pools[i] = av_buffer_pool_init2(sizes[i] + 16 + FRAME_POOL_ALIGN - 1,
+                                        NULL, frame_pool_alloc, NULL);
+    if(!fp->pools[i]) {
+      frame_pool_uninit(fp);
+      return -1;
+    }
+  }
+  fp->format = pic->format;
+  fp->width = pic->width;
+  fp->height = pic->height;
+  return 0;
+}
+
+/* get_buffer2 for the video decoder: frames come out of per-geometry
+ * pools, so steady state decoding does not allocate at all. Formats
+ * the pools cannot describe go to the default allocator.
+ */
+int our_get_buffer(struct AVCodecContext *c, AVFrame *pic,int flags) {
+  VideoState *is = (VideoState *)c->opaque;
+  FramePool *fp = &is->frame_pool;
+  const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get((enum AVPixelFormat)pic->format);
+  int i, ret = 0;
+
+  if(!(c->codec->capabilities & AV_CODEC_CAP_DR1) || !desc ||
+     (desc->flags & (AV_PIX_FMT_FLAG_HWACCEL | AV_PIX_FMT_FLAG_PAL)))
+    return avcodec_default_get_buffer2(c, pic, flags);
+
+  SDL_LockMutex(fp->mutex);
+  if(frame_pool_update(fp, c, pic) < 0) {
+    SDL_UnlockMutex(fp->mutex);
+    return avcodec_default_get_buffer2(c, pic, flags);
+  }
+  for(i = 0; i < 4 && fp->pools[i]; i++) {
+    pic->buf[i] = av_buffer_pool_get(fp->pools[i]);
+    if(!pic->buf[i]) {
+      ret = AVERROR(ENOMEM);
+      break;
+    }
+    pic->data[i] = pic->buf[i]->data;
+    pic->linesize[i] = fp->linesize[i];
+  }
+  SDL_UnlockMutex(fp->mutex);
+  if(ret < 0) {
+    av_frame_unref(pic);
+    return ret;
+  }
+  pic->extended_data = pic->data;
+  return 0;
+}
+
+/* Frame threading scales with cores but only pays off once a frame is
+   big enough to keep them busy; small streams just get extra latency. */
+static int video_decoder_threads(int width, int height) {
+  int pixels = width * height;
+  int threads;
+
+  if(decoder_threads > 0)
+    return FFMIN(decoder_threads, MAX_DECODER_THREADS);
+  if(pixels <= 640 * 480)
+    threads = 2;
+  else if(pixels <= 1280 * 720)
+    threads = 4;
+  else if(pixels <= 1920 * 1080)
+    threads = 8;
+  else
+    threads = MAX_DECODER_THREADS;
+  return av_clip(threads, 1, SDL_GetCPUCount());
+}
+
+static void video_decoder_set_threads(AVCodecContext *codecCtx, int threads) {
+  codecCtx->thread_count = threads;
+  codecCtx->thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
+}
+
+/* The thread count is fixed once a decoder is open, so changing it means
+   a fresh decoder. Only called on a keyframe, after draining the old one. */
+static int video_decoder_reopen(VideoState *is, int threads) {
+  AVCodecContext *codecCtx;
+  const AVCodec *codec;
+
+  codecCtx = avcodec_alloc_context3(NULL);
+  if(!codecCtx)
+    return -1;
+  if(avcodec_parameters_to_context(codecCtx, is->video_st->codecpar) < 0) {
+    avcodec_free_context(&codecCtx);
+    return -1;
+  }
+  codec = avcodec_find_decoder(codecCtx->codec_id);
+  video_decoder_set_threads(codecCtx, threads);
+  codecCtx->opaque = is;
+  codecCtx->get_buffer2 = our_get_buffer;
+  if(!codec || avcodec_open2(codecCtx, codec, NULL) < 0) {
+    avcodec_free_context(&codecCtx);
+    return -1;
+  }
+  avcodec_free_context(&is->video_codec_ctx);
+  is->video_codec_ctx = codecCtx;
+  is->video_threads = threads;
+  return 0;
+}
+
+/* How far a frame just decoded is behind where playback is. With video
+   as the master there is no other clock, but pictures that come out too
+   slowly leave video_refresh's schedule behind the wall clock. */
+static double video_decoder_lag(VideoState *is, double pts) {
+  if(is->av_sync_type == AV_SYNC_VIDEO_MASTER)
+    return av_gettime() / 1000000.0 - is->video_schedule - pts;
+  return get_master_clock(is) - pts;
+}
+
+/* -autothreads: add decoder threads while decoded frames come out behind
+   the master clock, give them back while the picture queue stays full.
+   A count we had to raise from becomes the floor, so we do not keep
+   bouncing off it. */
+static void video_decoder_update_lag(VideoState *is, double lag) {
+  double frame_duration;
+  int max_threads = FFMIN(SDL_GetCPUCount(), MAX_DECODER_THREADS);
+
+  if(!autothreads)
+    return;
+  is->decode_lag_cum += lag;
+  if(++is->decode_lag_count < DECODE_LAG_WINDOW)
+    return;
+
+  lag = is->decode_lag_cum / is->decode_lag_count;
+  is->decode_lag_cum = 0;
+  is->decode_lag_count = 0;
+  frame_duration = is->frame_last_delay;
+  if(lag > DECODE_LAG_RAISE && is->video_threads < max_threads) {
+    is->video_threads_floor = is->video_threads + 1;
+    is->video_threads_want = FFMIN(is->video_threads * 2, max_threads);
+  } else if(lag < -frame_duration * FFMAX(is->pictq_depth - 1, 1) &&
+            is->video_threads > is->video_threads_floor) {
+    is->video_threads_want = is->video_threads - 1;
+  }
+}
+
+/* Catch-up levels, each one giving up more picture to save decode time:
+   1 skips the loop filter, 2 also drops frames nothing refers to,
+   3 decodes keyframes only. Audio is never touched. */
+static void video_decoder_apply_skip(VideoState *is) {
+  AVCodecContext *codecCtx = is->video_codec_ctx;
+
+  codecCtx->skip_loop_filter = is->skip_level >= 1 ? AVDISCARD_ALL : AVDISCARD_DEFAULT;
+  codecCtx->skip_frame = is->skip_level >= 3 ? AVDISCARD_NONKEY :
+                         is->skip_level >= 2 ? AVDISCARD_NONREF : AVDISCARD_DEFAULT;
+}
+
+/* Step one level up while decoded frames come out behind the master
+   clock, one level down once they are ahead of it again. Decisions are
+   made on the average over DECODE_SKIP_INTERVAL so that a single slow
+   frame does not flip the level; with keyframes only that may be just
+   one frame. */
+static void video_decoder_update_skip(VideoState *is, double lag) {
+  int64_t now = av_gettime();
+  int level = is->skip_level;
+
+  if(!decoder_skip)
+    return;
+  is->skip_lag_cum += lag;
+  is->skip_lag_count++;
+  if(now - is->skip_time < DECODE_SKIP_INTERVAL)
+    return;
+
+  lag = is->skip_lag_cum / is->skip_lag_count;
+  is->skip_lag_cum = 0;
+  is->skip_lag_count = 0;
+  is->skip_time = now;
+  if(lag > DECODE_SKIP_BEHIND && level < 3)
+    level++;
+  else if(lag < -is->frame_last_delay && level > 0)
+    level--;
+  if(level != is->skip_level) {
+    fprintf(stderr, "%s: %.3f s behind, skip level %d -> %d\n",
+            is->filename, lag, is->skip_level, level);
+    is->skip_level = level;
+    video_decoder_apply_skip(is);
+  }
+}
+
+/* Pull every frame the decoder has ready and queue it for display. */
+static int video_receive_frames(VideoState *is, AVFrame *pFrame, int serial) {
   double pts;
+  int ret;
+
+  for(;;) {
+    int64_t start = av_gettime_relative();
+    ret = avcodec_receive_frame(is->video_codec_ctx, pFrame);
+    is->decode_time += av_gettime_relative() - start;
+    if(ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) {
+      return 0;
+    } else if(ret < 0) {
+      return 0;
+    }
+    if(is->video_pkt_serial != is->videoq.serial) {
+      /* a seek came in while we were decoding */
+      av_frame_unref(pFrame);
+      continue;
+    }
+    is->frames_decoded++;
+
+    /* frame threading hands frames back several packets late, so go by
+       the timestamp libavcodec carried along with the frame */
+    if(pFrame->best_effort_timestamp != AV_NOPTS_VALUE) {
+      pts = pFrame->best_effort_timestamp;
+    } else {
+      pts = 0;
+    }
+    pts *= av_q2d(is->video_st->time_base);
+
+    pts = synchronize_video(is, pFrame, pts);
+    if(serial == is->seek_target_serial &&
+       pFrame->best_effort_timestamp != AV_NOPTS_VALUE &&
+       pts < is->seek_target - is->frame_last_delay / 2) {
+      /* between the keyframe we landed on and the seek target */
+      is->frames_preroll++;
+      av_frame_unref(pFrame);
+      continue;
+    }
+    if(!is->paused && is->frames_displayed) {
+      double lag = video_decoder_lag(is, pts);
+      video_decoder_update_lag(is, lag);
+      video_decoder_update_skip(is, lag);
+    }
+    ret = queue_picture(is, pFrame, pts, serial);
+    av_frame_unref(pFrame);
+    if(ret < 0)
+      return -1;
+  }
+}
+
+int video_thread(void *arg) {
+  VideoState *is = (VideoState *)arg;
+  AVPacket pkt1, *packet = &pkt1;
+  int serial, preroll_skip = 0;
+  AVFrame *pFrame;
 
   pFrame = av_frame_alloc();
 
   for(;;) {
-    if(packet_queue_get(&is->videoq, packet, 1) < 0) {
+    if(packet_queue_get(&is->videoq, packet, 1, &serial) < 0) {
       // means we quit getting packets
       break;
     }
-    if(packet->data == flush_pkt.data) {
+    if(serial != is->video_pkt_serial) {
+      /* first packet after a seek */
       avcodec_flush_buffers(is->video_codec_ctx);
+      is->video_pkt_serial = serial;
+      /* the clocks jump, what we measured so far means nothing */
+      is->decode_lag_cum = is->skip_lag_cum = 0;
+      is->decode_lag_count = is->skip_lag_count = 0;
+      is->skip_time = av_gettime();
+    }
+    if(serial != is->videoq.serial) {
+      /* pulled just before a seek, don't bother decoding it */
+      av_packet_unref(packet);
       continue;
     }
-    pts = 0;
+    if(is->video_threads_want &&
+       is->video_threads_want != is->video_threads &&
+       (packet->flags & AV_PKT_FLAG_KEY)) {
+      /* nothing after a keyframe refers back past it, so this is where
+         the decoder can be swapped; drain what the old one still has */
+      avcodec_send_packet(is->video_codec_ctx, NULL);
+      if(video_receive_frames(is, pFrame, serial) < 0) {
+        av_packet_unref(packet);
+        break;
+      }
+      if(video_decoder_reopen(is, is->video_threads_want) < 0) {
+        fprintf(stderr, "%s: could not reopen the video decoder with %d threads\n",
+                is->filename, is->video_threads_want);
+        avcodec_flush_buffers(is->video_codec_ctx);
+      } else {
+        fprintf(stderr, "%s: video decoder now on %d threads\n",
+                is->filename, is->video_threads);
+      }
+      video_decoder_apply_skip(is);
+      is->video_threads_want = 0;
+    }
+
+    if(serial == is->seek_target_serial && packet->pts != AV_NOPTS_VALUE &&
+       packet->pts * av_q2d(is->video_st->time_base) <
+       is->seek_target - is->frame_last_delay) {
+      /* on the way to a seek target: this picture is never shown, so if
+         no other picture refers to it, it need not be decoded at all */
+      if(is->video_codec_ctx->skip_frame < AVDISCARD_NONREF)
+        is->video_codec_ctx->skip_frame = AVDISCARD_NONREF;
+      preroll_skip = 1;
+    } else if(preroll_skip) {
+      video_decoder_apply_skip(is);
+      preroll_skip = 0;
+    }
 
-    // Save global pts to be stored in pFrame in first call
-    global_video_pkt_pts = packet->pts;
     // Decode video frame
     //avcodec_decode_video2(is->video_st->codecpar, pFrame, &frameFinished,packet);
+    int64_t start = av_gettime_relative();
     int ret = avcodec_send_packet(is->video_codec_ctx,packet);
+    is->decode_time += av_gettime_relative() - start;
+    /* the decoder holds its own reference to the data */
+    av_packet_unref(packet);
     if(ret < 0)
     {
-        is->video_codec_ctx = 0;
-        break;
-    }
-    while(ret >= 0)
-    {
-        ret = avcodec_receive_frame(is->video_codec_ctx,pFrame);
-        if(ret == AVERROR(EAGAIN) || ret == AVERROR_EOF)
-        {
-            break;
-        }else if(ret < 0)
-        {
-            break;
-        }
-        frameFinished = 1;
-
-        if(packet->dts == AV_NOPTS_VALUE
-           && pFrame->opaque && *(uint64_t*)pFrame->opaque != AV_NOPTS_VALUE)
-        {
-          pts = *(uint64_t *)pFrame->opaque;
-        } else if(packet->dts != AV_NOPTS_VALUE)
-        {
-          pts = packet->dts;
-        } else
-        {
-          pts = 0;
-        }
-        pts *= av_q2d(is->video_st->time_base);
-
-        // Did we get a video frame?
-        if(frameFinished)
-        {
-          pts = synchronize_video(is, pFrame, pts);
-          if(queue_picture(is, pFrame, pts) < 0)
-          {
-        break;
-          }
-        }
-        av_packet_unref(packet);
+        /* if error, skip packet */
+        continue;
     }
+    if(video_receive_frames(is, pFrame, serial) < 0)
+      break;
   }
-  av_free(pFrame);
+  av_frame_free(&pFrame);
   return 0;
 }
 int stream_component_open(VideoState *is, int stream_index) {
@@ -901,17 +2089,31 @@ int stream_component_open(VideoState *is, int stream_index) {
     // Set audio settings from codec info
     wanted_spec.freq = codecCtx->sample_rate;
     wanted_spec.format = AUDIO_S16SYS;
-    wanted_spec.channels = codecCtx->channels;
+    wanted_spec.channels = codecCtx->ch_layout.nb_channels;
     wanted_spec.silence = 0;
     wanted_spec.samples = SDL_AUDIO_BUFFER_SIZE;
     wanted_spec.callback = audio_callback;
     wanted_spec.userdata = is;
 
-    if(SDL_OpenAudio(&wanted_spec, &spec) < 0) {
-      fprintf(stderr, "SDL_OpenAudio: %s\n", SDL_GetError());
+    is->audio_dev = SDL_OpenAudioDevice(NULL, 0, &wanted_spec, &spec, 0);
+    if(!is->audio_dev) {
+      fprintf(stderr, "SDL_OpenAudioDevice: %s\n", SDL_GetError());
       return -1;
     }
     is->audio_hw_buf_size = spec.size;
+    if(audio_ring_init(&is->audio_ring, spec.freq * spec.channels * 2,
+                       audio_ahead_ms) < 0) {
+      fprintf(stderr, "Could not allocate the audio ring\n");
+      return -1;
+    }
+  }
+  if(codecCtx->codec_type == AVMEDIA_TYPE_VIDEO) {
+    /* threading and get_buffer2 have to be in place before the open */
+    is->video_threads = video_decoder_threads(codecCtx->width, codecCtx->height);
+    is->video_threads_floor = 1;
+    video_decoder_set_threads(codecCtx, is->video_threads);
+    codecCtx->opaque = is;
+    codecCtx->get_buffer2 = our_get_buffer;
   }
   codec = avcodec_find_decoder(codecCtx->codec_id);
   if(!codec || (avcodec_open2(codecCtx, codec, &optionsDict) < 0)) {
@@ -921,10 +2123,9 @@ int stream_component_open(VideoState *is, int stream_index) {
 
   switch(codecCtx->codec_type) {
   case AVMEDIA_TYPE_AUDIO:
+    is->audio_codec_ctx = codecCtx;
     is->audioStream = stream_index;
     is->audio_st = pFormatCtx->streams[stream_index];
-    is->audio_buf_size = 0;
-    is->audio_buf_index = 0;
 
     /* averaging filter for audio sync */
     is->audio_diff_avg_coef = exp(log(0.01 / AUDIO_DIFF_AVG_NB));
@@ -939,18 +2140,25 @@ int stream_component_open(VideoState *is, int stream_index) {
     }
 
     memset(&is->audio_pkt, 0, sizeof(is->audio_pkt));
-    packet_queue_init(&is->audioq);
-    SDL_PauseAudio(0);
+    packet_queue_init(&is->audioq, is->audio_st,
+                      MAX_AUDIOQ_DURATION, MAX_AUDIOQ_SIZE,
+                      is->continue_read_mutex, is->continue_read_cond);
+    is->audio_tid = SDL_CreateThread(audio_thread, "audio_thread", is);
+    SDL_PauseAudioDevice(is->audio_dev, 0);
     break;
   case AVMEDIA_TYPE_VIDEO:
+    is->video_codec_ctx = codecCtx;
     is->videoStream = stream_index;
     is->video_st = pFormatCtx->streams[stream_index];
 
     is->frame_timer = (double)av_gettime() / 1000000.0;
     is->frame_last_delay = 40e-3;
     is->video_current_pts_time = av_gettime();
+    is->skip_time = av_gettime();
 
-    packet_queue_init(&is->videoq);
+    packet_queue_init(&is->videoq, is->video_st,
+                      MAX_VIDEOQ_DURATION, MAX_VIDEOQ_SIZE,
+                      is->continue_read_mutex, is->continue_read_cond);
 
 //    if(avcodec_open2(is->video_codec_ctx,codec,NULL) < 0)
 //    {
@@ -958,23 +2166,19 @@ int stream_component_open(VideoState *is, int stream_index) {
 //        return -1;
 //    }
 
+    if(scale_pool_init(&is->scale_pool, codecCtx->width, codecCtx->height) < 0) {
+      fprintf(stderr, "Could not set up colour conversion\n");
+      return -1;
+    }
+    /* have the main thread create the textures while we get going */
+    is->prealloc_format = texture_format_for(is, codecCtx->pix_fmt);
+    if(is->prealloc_format == SDL_PIXELFORMAT_UNKNOWN)
+      is->prealloc_format = SDL_PIXELFORMAT_YV12;
+    is->prealloc_width = codecCtx->width;
+    is->prealloc_height = codecCtx->height;
+    is->prealloc_pending = 1;
+    present_wake(is);
     is->video_tid = SDL_CreateThread(video_thread, "video_thread",is);
-    is->sws_ctx =
-        sws_getContext
-        (
-            codecCtx->width,
-            codecCtx->height,
-            codecCtx->pix_fmt,
-            codecCtx->width,
-            codecCtx->height,
-            AV_PIX_FMT_YUV420P,
-            SWS_BILINEAR,
-            NULL,
-            NULL,
-            NULL
-        );
-    codecCtx->get_buffer2 = our_get_buffer;
-    //codecCtx->release_buffer = our_release_buffer;
 
     break;
   default:
@@ -984,7 +2188,66 @@ int stream_component_open(VideoState *is, int stream_index) {
 }
 
 int decode_interrupt_cb(void *opaque) {
-  return (global_video_state && global_video_state->quit);
+  VideoState *is = (VideoState *)opaque;
+  return is->quit;
+}
+/* Reads the whole file once, next to playback, to write the keyframe
+   index sidecar; seeks use the index as soon as it is published. */
+static int index_thread(void *arg) {
+  VideoState *is = (VideoState *)arg;
+  KeyframeIndex *index = NULL;
+  AVIOInterruptCB callback;
+  int64_t start = av_gettime_relative();
+
+  callback.callback = decode_interrupt_cb;
+  callback.opaque = is;
+  if(keyframe_index_build(is->filename, is->index_path, is->videoStream,
+                          &callback, &index) >= 0 && index) {
+    fprintf(stderr, "%s: indexed %d keyframes in %.1f s\n", is->filename,
+            index->nb_entries, (av_gettime_relative() - start) / 1000000.0);
+    is->kf_index = index;
+  }
+  return 0;
+}
+/* Give the demuxer the index entries the sidecar recorded from its own
+   index, so seeking by timestamp finds the keyframe's resume point
+   straight away even where the container has no index of its own (an
+   MKV without cues) or only knows what it has read so far. Demuxers
+   whose index already covers every keyframe (MP4's sample table) are
+   left alone. Runs on decode_thread, which owns pFormatCtx. */
+static void stream_feed_index(VideoState *is, const KeyframeIndex *index) {
+  AVStream *st = is->pFormatCtx->streams[index->stream_index];
+  int i;
+
+  is->kf_index_fed = 1;
+  if(avformat_index_get_entries_count(st) >= index->nb_entries)
+    return;
+  for(i = 0; i < index->nb_entries; i++) {
+    const KeyframeEntry *e = &index->entries[i];
+    if(e->index_pos >= 0)
+      av_add_index_entry(st, e->index_pos, e->index_ts, e->size, 0,
+                         AVINDEX_KEYFRAME);
+  }
+}
+/* Jump to the indexed keyframe at or before ts (in the stream's time
+   base). Containers that pick up again at any byte (MPEG-TS/PS, raw
+   streams) go by its position, which does not depend on their
+   timestamps. The rest go by timestamp, which stream_feed_index has
+   put in the demuxer's index when it had no entry of its own. */
+static int stream_seek_indexed(VideoState *is, const KeyframeIndex *index, int64_t ts) {
+  AVFormatContext *fmt = is->pFormatCtx;
+  const KeyframeEntry *e = keyframe_index_find(index, ts);
+
+  if(!e)
+    return -1;
+  if(e->pos >= 0 && !(fmt->iformat->flags & AVFMT_NO_BYTE_SEEK) &&
+     (fmt->iformat->flags & (AVFMT_TS_DISCONT | AVFMT_NOTIMESTAMPS)))
+    return av_seek_frame(fmt, -1, e->pos, AVSEEK_FLAG_BYTE);
+  if(!is->kf_index_fed)
+    stream_feed_index(is, index);
+  return av_seek_frame(fmt, index->stream_index,
+                       e->index_pos >= 0 ? e->index_ts : keyframe_entry_ts(e),
+                       AVSEEK_FLAG_BACKWARD);
 }
 int decode_thread(void *arg) {
 
@@ -992,8 +2255,9 @@ int decode_thread(void *arg) {
   AVFormatContext *pFormatCtx = NULL;
   AVPacket pkt1, *packet = &pkt1;
 
-  AVDictionary *io_dict = NULL;
   AVIOInterruptCB callback;
+  ProbeKey file_key; /* names the probe cache entry and the sidecar */
+  int have_key = 0;
 
   int video_index = -1;
   int audio_index = -1;
@@ -1002,25 +2266,52 @@ int decode_thread(void *arg) {
   is->videoStream=-1;
   is->audioStream=-1;
 
-  global_video_state = is;
   // will interrupt blocking functions if we quit!
   callback.callback = decode_interrupt_cb;
   callback.opaque = is;
-  if (avio_open2(&is->io_context, is->filename, 0, &callback, &io_dict))
-  {
-    fprintf(stderr, "Unable to open I/O for %s\n", is->filename);
-    return -1;
-  }
 
   // Open video file
+  pFormatCtx = avformat_alloc_context();
+  if(!pFormatCtx)
+    goto fail;
+  pFormatCtx->interrupt_callback = callback;
+  /* only matter to files the probe cache doesn't know */
+  if(probesize > 0)
+    pFormatCtx->probesize = probesize;
+  if(analyzeduration > 0)
+    pFormatCtx->max_analyze_duration = analyzeduration;
+  /* local files are read out of a mapping, or through read-ahead for
+     slow storage; everything else (and a file that cannot be mapped)
+     goes through the usual protocols */
+  if(readahead_blocks >= 0) {
+    if(readahead_io_open(&is->io_context, is->filename, readahead_blocks,
+                         READAHEAD_BLOCK_SIZE, io_latency_us, &callback) >= 0)
+      is->io_readahead = 1;
+  } else if(use_mmap) {
+    mmap_io_open(&is->io_context, is->filename);
+  }
+  if(is->io_context) {
+    pFormatCtx->pb = is->io_context;
+    pFormatCtx->flags |= AVFMT_FLAG_CUSTOM_IO;
+  }
   if(avformat_open_input(&pFormatCtx, is->filename, NULL, NULL)!=0)
-    return -1; // Couldn't open file
+    goto fail; // Couldn't open file
 
   is->pFormatCtx = pFormatCtx;
 
-  // Retrieve stream information
-  if(avformat_find_stream_info(pFormatCtx, NULL)<0)
-    return -1; // Couldn't find stream information
+  // Retrieve stream information, from the cache if we have seen the
+  // file before
+  if(use_probe_cache || keyframe_indexing)
+    have_key = probe_cache_key(&file_key, is->filename) >= 0;
+  if(have_key && use_probe_cache)
+    is->probe_cached = probe_cache_load(probe_cache_dir, &file_key, pFormatCtx) > 0;
+  if(!is->probe_cached) {
+    if(avformat_find_stream_info(pFormatCtx, NULL)<0)
+      goto fail; // Couldn't find stream information
+    if(have_key && use_probe_cache)
+      probe_cache_store(probe_cache_dir, &file_key, pFormatCtx);
+  }
+  is->probe_time = av_gettime_relative() - is->open_time;
 
   // Dump information about file onto standard error
   av_dump_format(pFormatCtx, 0, is->filename, 0);
@@ -1036,6 +2327,11 @@ int decode_thread(void *arg) {
       audio_index=i;
     }
   }
+  /* the decoders read it from their first frame on */
+  if(sync_type >= 0)
+    is->av_sync_type = sync_type;
+  else if(audio_index < 0)
+    is->av_sync_type = AV_SYNC_VIDEO_MASTER;
   if(audio_index >= 0) {
     stream_component_open(is, audio_index);
   }
@@ -1048,6 +2344,20 @@ int decode_thread(void *arg) {
     goto fail;
   }
 
+  if(have_key && keyframe_indexing) {
+    KeyframeIndex *index = NULL;
+
+    probe_cache_path(is->index_path, sizeof(is->index_path),
+                     probe_cache_dir, &file_key, "kfi");
+    if(keyframe_index_load(is->index_path, is->videoStream, &index) > 0 &&
+       !av_cmp_q(index->time_base, is->video_st->time_base)) {
+      is->kf_index = index;
+    } else {
+      keyframe_index_free(&index);
+      is->index_tid = SDL_CreateThread(index_thread, "index_thread", is);
+    }
+  }
+
   // main decode loop
 
   for(;;) {
@@ -1057,7 +2367,17 @@ int decode_thread(void *arg) {
     // seek stuff goes here
     if(is->seek_req) {
       int stream_index= -1;
-      int64_t seek_target = is->seek_pos;
+      int64_t seek_target, seek_pos, seek_time;
+      int seek_flags, ret = -1, indexed = 0;
+      KeyframeIndex *index = is->kf_index;
+
+      /* take the latest request; anything newer restarts the seek */
+      SDL_LockMutex(is->continue_read_mutex);
+      seek_target = seek_pos = is->seek_pos;
+      seek_flags = is->seek_flags;
+      seek_time = is->seek_req_time;
+      is->seek_req = 0;
+      SDL_UnlockMutex(is->continue_read_mutex);
 
       if     (is->videoStream >= 0) stream_index = is->videoStream;
       else if(is->audioStream >= 0) stream_index = is->audioStream;
@@ -1065,34 +2385,103 @@ int decode_thread(void *arg) {
       if(stream_index>=0){
     seek_target= av_rescale_q(seek_target, AV_TIME_BASE_Q, pFormatCtx->streams[stream_index]->time_base);
       }
-      if(av_seek_frame(is->pFormatCtx, stream_index, seek_target, is->seek_flags) < 0) {
+      if(index && stream_index == index->stream_index &&
+         !av_cmp_q(index->time_base, is->video_st->time_base)) {
+    /* straight to the keyframe before the target, then decode
+       forward to the target itself */
+    ret = stream_seek_indexed(is, index, seek_target);
+    indexed = ret >= 0;
+      }
+      if(ret < 0) {
+    /* an exact seek has to land before the target to decode up to it */
+    if(exact_seek)
+      seek_flags |= AVSEEK_FLAG_BACKWARD;
+    ret = av_seek_frame(is->pFormatCtx, stream_index, seek_target, seek_flags);
+      }
+      if(ret < 0) {
     fprintf(stderr, "%s: error while seeking\n", is->pFormatCtx->url);
       } else {
+    /* for the latency report when its first picture goes up */
+    is->seek_exact = indexed || exact_seek;
+    is->seek_start_preroll = is->frames_preroll;
+    /* stored ahead of seek_start_time and the serials, whose loads
+       on the other threads then see it and the fields above */
+    is->seek_target = (double)seek_pos / AV_TIME_BASE;
+    is->seek_start_time = seek_time;
     if(is->audioStream >= 0) {
       packet_queue_flush(&is->audioq);
-      packet_queue_put(&is->audioq, &flush_pkt);
+      if(is->seek_exact)
+        is->audio_seek_target_serial = is->audioq.serial.load();
     }
     if(is->videoStream >= 0) {
       packet_queue_flush(&is->videoq);
-      packet_queue_put(&is->videoq, &flush_pkt);
+      if(is->seek_exact)
+        is->seek_target_serial = is->videoq.serial.load();
     }
       }
-      is->seek_req = 0;
     }
 
-    if(is->audioq.size > MAX_AUDIOQ_SIZE ||
-       is->videoq.size > MAX_VIDEOQ_SIZE) {
-      SDL_Delay(10);
+    if(is->paused) {
+      /* nothing to do until we are resumed */
+      av_read_pause(is->pFormatCtx);
+      SDL_LockMutex(is->continue_read_mutex);
+      while(is->paused && !is->seek_req && !is->quit) {
+        SDL_CondWait(is->continue_read_cond, is->continue_read_mutex);
+      }
+      SDL_UnlockMutex(is->continue_read_mutex);
+      av_read_play(is->pFormatCtx);
+      continue;
+    }
+    if(packet_queue_full(&is->audioq) ||
+       packet_queue_full(&is->videoq)) {
+      /* sleep until the consumers have drained the full queues */
+      SDL_LockMutex(is->continue_read_mutex);
+      if(packet_queue_full(&is->audioq))
+        packet_queue_want_space(&is->audioq);
+      if(packet_queue_full(&is->videoq))
+        packet_queue_want_space(&is->videoq);
+      while((is->audioq.put_waiting || is->videoq.put_waiting) &&
+            !is->seek_req && !is->quit) {
+        SDL_CondWait(is->continue_read_cond, is->continue_read_mutex);
+      }
+      is->audioq.put_waiting = 0;
+      is->videoq.put_waiting = 0;
+      SDL_UnlockMutex(is->continue_read_mutex);
+      continue;
+    }
+    if((is->audioStream < 0 || packet_queue_enough(&is->audioq)) &&
+       (is->videoStream < 0 || packet_queue_enough(&is->videoq))) {
+      /* every stream has its time budget: sleep until either one has
+         drained, a single full queue must not starve the other one */
+      SDL_LockMutex(is->continue_read_mutex);
+      if(is->audioStream >= 0)
+        packet_queue_want_space(&is->audioq);
+      if(is->videoStream >= 0)
+        packet_queue_want_space(&is->videoq);
+      while((is->audioStream < 0 || is->audioq.put_waiting) &&
+            (is->videoStream < 0 || is->videoq.put_waiting) &&
+            !is->seek_req && !is->quit) {
+        SDL_CondWait(is->continue_read_cond, is->continue_read_mutex);
+      }
+      is->audioq.put_waiting = 0;
+      is->videoq.put_waiting = 0;
+      SDL_UnlockMutex(is->continue_read_mutex);
       continue;
     }
     if(av_read_frame(is->pFormatCtx, packet) < 0) {
       if(is->pFormatCtx->pb->error == 0) {
-    SDL_Delay(100); /* no error; wait for user input */
+    /* no error; wait for user input */
+    SDL_LockMutex(is->continue_read_mutex);
+    while(!is->seek_req && !is->quit) {
+      SDL_CondWait(is->continue_read_cond, is->continue_read_mutex);
+    }
+    SDL_UnlockMutex(is->continue_read_mutex);
     continue;
       } else {
     break;
       }
     }
+    is->bytes_demuxed += packet->size;
     // Is this a packet from the video stream?
     if(packet->stream_index == is->videoStream) {
       packet_queue_put(&is->videoq, packet);
@@ -1103,11 +2492,15 @@ int decode_thread(void *arg) {
     }
   }
   /* all done - wait for it */
+  SDL_LockMutex(is->continue_read_mutex);
   while(!is->quit) {
-    SDL_Delay(100);
+    SDL_CondWait(is->continue_read_cond, is->continue_read_mutex);
   }
+  SDL_UnlockMutex(is->continue_read_mutex);
  fail:
-  {
+  if(!is->quit) {
+    /* tell the main loop to close us; it ignores players it has
+       already closed */
     SDL_Event event;
     event.type = FF_QUIT_EVENT;
     event.user.data1 = is;
@@ -1116,79 +2509,429 @@ int decode_thread(void *arg) {
   return 0;
 }
 
+/* A request that arrives while another one is pending replaces it, so
+   a burst of seeks costs a single av_seek_frame to the last target. */
 void stream_seek(VideoState *is, int64_t pos, int rel) {
 
-  if(!is->seek_req) {
-    is->seek_pos = pos;
-    is->seek_flags = rel < 0 ? AVSEEK_FLAG_BACKWARD : 0;
-    is->seek_req = 1;
+  SDL_LockMutex(is->continue_read_mutex);
+  is->seek_pos = pos;
+  is->seek_flags = rel < 0 ? AVSEEK_FLAG_BACKWARD : 0;
+  is->seek_req = 1;
+  is->seek_req_time = av_gettime_relative();
+  SDL_CondSignal(is->continue_read_cond);
+  SDL_UnlockMutex(is->continue_read_mutex);
+}
+/* Where a relative seek starts from: until the first picture of the
+   last seek is on screen the clocks still describe the old position,
+   so repeated key presses build on the pending target instead. */
+double get_seek_base(VideoState *is) {
+  if(is->seek_req || is->video_current_serial != is->videoq.serial) {
+    return (double)is->seek_pos / AV_TIME_BASE;
   }
+  return get_master_clock(is);
 }
-int main(int argc, char *argv[]) {
-//int main(void) {
-
-  SDL_Event       event;
-  //double          pts;
-  VideoState      *is;
-
-  is = (VideoState*)av_mallocz(sizeof(VideoState));
+void toggle_pause(VideoState *is) {
 
-  if(argc < 2) {
-    fprintf(stderr, "Usage: test <file>\n");
-    exit(1);
+  if(!is->paused) {
+    is->pause_time = av_gettime();
+  } else {
+    /* don't count the time we spent paused; done before unpausing as
+       video_refresh picks frame_timer up as soon as it sees that */
+    is->frame_timer += (av_gettime() - is->pause_time) / 1000000.0;
+    is->video_schedule = is->video_schedule.load() +
+                         (av_gettime() - is->pause_time) / 1000000.0;
+    is->video_current_pts_time = av_gettime();
+  }
+  is->paused = !is->paused;
+  SDL_PauseAudioDevice(is->audio_dev, is->paused);
+  present_wake(is);
+  wake_read_thread(is);
+}
+/* frames decoded/displayed and input bitrate since the last call */
+void print_stats(VideoState *is) {
+  int64_t now = av_gettime();
+  double elapsed = (now - is->stats_time) / 1000000.0;
+  int decoded = is->frames_decoded, displayed = is->frames_displayed;
+  int64_t bytes = is->bytes_demuxed;
+  int64_t io_buffered = 0, io_direct = 0, io_wait_time = 0;
+  int io_waits = 0;
+
+  /* bytes copied by the input layer: with the default protocols all of
+     it goes through the AVIO buffer, mmap_io hands most of it straight
+     to the packets */
+  if(is->io_readahead) {
+    readahead_io_stats(is->io_context, &io_buffered, &io_direct,
+                       &io_waits, &io_wait_time);
+  } else if(is->io_context) {
+    mmap_io_stats(is->io_context, &io_buffered, &io_direct);
+  } else if(is->pFormatCtx && is->pFormatCtx->pb) {
+    io_buffered = is->pFormatCtx->pb->bytes_read;
   }
-  // Register all formats and codecs
-  //av_register_all();
 
-  if(SDL_Init(SDL_INIT_VIDEO | SDL_INIT_AUDIO | SDL_INIT_TIMER)) {
-    fprintf(stderr, "Could not initialize SDL - %s\n", SDL_GetError());
-    exit(1);
+  if(elapsed > 0) {
+    fprintf(stderr, "%s: decoded %.1f fps, displayed %.1f fps, demuxed %.2f Mbit/s, "
+            "%d dropped, %d late, %d preroll, %d converted (%d scaler builds), %d decoder threads, "
+            "skip level %d, audio %d ms ahead, %d underruns\n",
+            is->filename,
+            (decoded - is->stats_decoded) / elapsed,
+            (displayed - is->stats_displayed) / elapsed,
+            (bytes - is->stats_bytes) * 8 / elapsed / 1000000.0,
+            is->frames_dropped.load(), is->frames_late.load(),
+            is->frames_preroll.load(),
+            is->frames_converted.load(), is->scale_pool.nb_builds,
+            is->video_threads, is->skip_level,
+            audio_ring_fill_ms(&is->audio_ring), is->audio_ring.underruns.load());
+    /* averages since the start, per frame that went through each stage */
+    fprintf(stderr, "%s: decode %.2f ms/frame, convert %.2f ms/frame, upload %.2f ms/frame\n",
+            is->filename,
+            is->decode_time / 1000.0 / FFMAX(decoded, 1),
+            is->convert_time / 1000.0 / FFMAX(is->frames_converted.load(), 1),
+            is->upload_time / 1000.0 / FFMAX(is->frames_uploaded.load(), 1));
+    fprintf(stderr, "%s: %s input copied %.2f MB/s through the AVIO buffer, "
+            "%.2f MB/s straight into packets\n",
+            is->filename,
+            is->io_readahead ? "read-ahead" : is->io_context ? "mmap" : "avio",
+            (io_buffered - is->stats_io_buffered) / elapsed / 1000000.0,
+            (io_direct - is->stats_io_direct) / elapsed / 1000000.0);
+    if(is->io_readahead) {
+      /* totals: how often the demuxer still had to wait on storage */
+      fprintf(stderr, "%s: read-ahead %d waits, %.1f ms waiting\n",
+              is->filename, io_waits, io_wait_time / 1000.0);
+    }
   }
+  is->stats_time = now;
+  is->stats_decoded = decoded;
+  is->stats_displayed = displayed;
+  is->stats_bytes = bytes;
+  is->stats_io_buffered = io_buffered;
+  is->stats_io_direct = io_direct;
+}
+static Uint32 sdl_stats_timer_cb(Uint32 interval, void *) {
+  SDL_Event event;
+  event.type = FF_STATS_EVENT;
+  SDL_PushEvent(&event);
+  return interval;
+}
+/* Must be called from the main thread, which owns the window. */
+VideoState *stream_open(const char *filename) {
+
+  VideoState *is;
+
+  is = (VideoState*)av_mallocz(sizeof(VideoState));
+  if(!is)
+    return NULL;
 
   // Make a screen to put our video
 #ifndef __DARWIN__
   //screen = SDL_SetVideoMode(640, 480, 0, 0);
-  window = SDL_CreateWindow("video player",
+  is->window = SDL_CreateWindow(filename,
                             SDL_WINDOWPOS_UNDEFINED,
                             SDL_WINDOWPOS_UNDEFINED,
                             640, 480,
                             //SDL_WINDOW_FULLSCREEN | SDL_WINDOW_OPENGL
-                            SDL_WINDOW_SHOWN);
+                            SDL_WINDOW_SHOWN | SDL_WINDOW_RESIZABLE);
 #else
-  window = SDL_CreateWindow("video player",
+  is->window = SDL_CreateWindow(filename,
                             SDL_WINDOWPOS_UNDEFINED,
                             SDL_WINDOWPOS_UNDEFINED,
                             640, 320,
                             //SDL_WINDOW_FULLSCREEN | SDL_WINDOW_OPENGL
-                            SDL_WINDOW_SHOWN);
+                            SDL_WINDOW_SHOWN | SDL_WINDOW_RESIZABLE);
 #endif
-  if(!window) {
-    fprintf(stderr, "SDL: could not create window - exiting\n");
-    exit(1);
+  if(!is->window) {
+    fprintf(stderr, "SDL: could not create window - %s\n", SDL_GetError());
+    av_free(is);
+    return NULL;
+  }
+  {
+    int window_w, window_h;
+    SDL_GetWindowSize(is->window, &window_w, &window_h);
+    is->window_w = window_w;
+    is->window_h = window_h;
   }
 
-  av_strlcpy(is->filename, argv[1], 1024);
+  av_strlcpy(is->filename, filename, sizeof(is->filename));
+  is->open_time = av_gettime_relative();
+  is->seek_target_serial = -1;
+  is->audio_seek_target_serial = -1;
 
   is->pictq_mutex = SDL_CreateMutex();
+  is->frame_pool.mutex = SDL_CreateMutex();
+  is->frame_pool.format = AV_PIX_FMT_NONE;
   is->pictq_cond = SDL_CreateCond();
+  is->present_due = -1;
+  is->continue_read_mutex = SDL_CreateMutex();
+  is->continue_read_cond = SDL_CreateCond();
+  is->stats_time = av_gettime();
+  is->pictq_depth = pictq_depth;
+  for(int i = 0; i < is->pictq_depth; i++) {
+    is->pictq[i].frame = av_frame_alloc();
+    is->pictq[i].convert_frame = av_frame_alloc();
+  }
 
-  schedule_refresh(is, 40);
+  /* the decoder picks texture formats from the renderer's list, so
+     that has to be there before it starts */
+  if(video_open_renderer(is) < 0) {
+    SDL_DestroyWindow(is->window);
+    av_free(is);
+    return NULL;
+  }
 
   is->av_sync_type = DEFAULT_AV_SYNC_TYPE;
   is->parse_tid = SDL_CreateThread(decode_thread, "decode_thread",is);
   if(!is->parse_tid) {
+    video_close_renderer(is);
+    SDL_DestroyWindow(is->window);
     av_free(is);
-    return -1;
+    return NULL;
   }
+  return is;
+}
+/* Stop every thread of a player and free it. Must be called from the
+   main thread. */
+void stream_close(VideoState *is) {
 
-  av_init_packet(&flush_pkt);
-  flush_pkt.data = (unsigned char *)"FLUSH";
+  int i;
 
-  for(;;) {
+  is->quit = 1;
+  /*
+   * If the video has finished playing, then both the picture and
+   * audio queues are waiting for more data.  Make them stop
+   * waiting and terminate normally.
+   */
+  packet_queue_abort(&is->audioq);
+  packet_queue_abort(&is->videoq);
+  audio_ring_abort(&is->audio_ring);
+  wake_read_thread(is);
+  SDL_LockMutex(is->pictq_mutex);
+  SDL_CondBroadcast(is->pictq_cond);
+  SDL_UnlockMutex(is->pictq_mutex);
+
+  SDL_WaitThread(is->parse_tid, NULL);
+  SDL_WaitThread(is->video_tid, NULL);
+  SDL_WaitThread(is->audio_tid, NULL);
+  SDL_WaitThread(is->index_tid, NULL);
+  {
+    KeyframeIndex *index = is->kf_index;
+    keyframe_index_free(&index);
+  }
+  if(is->audio_dev) {
+    SDL_CloseAudioDevice(is->audio_dev);
+  }
+
+  print_stats(is);
+  packet_queue_dump_stats(&is->audioq, "audioq");
+  packet_queue_dump_stats(&is->videoq, "videoq");
+
+  packet_queue_destroy(&is->audioq);
+  packet_queue_destroy(&is->videoq);
+  audio_ring_destroy(&is->audio_ring);
+  av_packet_unref(&is->audio_pkt);
+  av_frame_unref(&is->audio_frame);
+  avcodec_free_context(&is->audio_codec_ctx);
+  avcodec_free_context(&is->video_codec_ctx);
+  frame_pool_uninit(&is->frame_pool);
+  SDL_DestroyMutex(is->frame_pool.mutex);
+  swr_free(&is->swr_ctx_audio);
+  av_channel_layout_uninit(&is->audio_src_ch_layout);
+  scale_pool_destroy(&is->scale_pool);
+  avformat_close_input(&is->pFormatCtx);
+  if(is->io_readahead)
+    readahead_io_close(&is->io_context);
+  else
+    mmap_io_close(&is->io_context);
+
+  for(i = 0; i < VIDEO_PICTURE_QUEUE_MAX; i++) {
+    av_frame_free(&is->pictq[i].frame);
+    av_frame_free(&is->pictq[i].convert_frame);
+  }
+  video_close_renderer(is);
+  SDL_DestroyWindow(is->window);
+  SDL_DestroyCond(is->pictq_cond);
+  SDL_DestroyMutex(is->pictq_mutex);
+  SDL_DestroyCond(is->continue_read_cond);
+  SDL_DestroyMutex(is->continue_read_mutex);
+  av_free(is);
+}
+/* Events may still be in flight for a player that has been closed. */
+static VideoState *find_player(VideoState **players, int nb_players,
+                               VideoState *is, Uint32 window_id) {
+  int i;
+
+  for(i = 0; i < nb_players; i++) {
+    if(is ? players[i] == is : SDL_GetWindowID(players[i]->window) == window_id)
+      return players[i];
+  }
+  return NULL;
+}
+static int remove_player(VideoState **players, int nb_players, VideoState *is) {
+  int i;
+
+  for(i = 0; i < nb_players; i++) {
+    if(players[i] == is) {
+      players[i] = players[--nb_players];
+      stream_close(is);
+      break;
+    }
+  }
+  return nb_players;
+}
+int main(int argc, char *argv[]) {
+//int main(void) {
+
+  SDL_Event       event;
+  //double          pts;
+  VideoState      *is;
+  VideoState      *players[MAX_PLAYERS];
+  int             nb_players = 0;
+  const char      *files[MAX_PLAYERS];
+  int             nb_files = 0;
+  int             i;
+
+  if(argc < 2) {
+    fprintf(stderr, "Usage: test [-audio_ahead <ms>] [-pictq <n>] [-noframedrop] "
+            "[-sync audio|video] [-threads <n>] [-autothreads] [-noskip] "
+            "[-scale_threads <n>] "
+            "[-novsync] [-nommap] [-readahead <blocks>] [-io_latency <ms>] "
+            "[-probesize <bytes>] [-analyzeduration <us>] "
+            "[-probe_cache <dir>] [-noprobecache] [-noindex] [-exact_seek] <file> [<file> ...]\n"
+            "       test -bench_convert\n");
+    exit(1);
+  }
+  if(!strcmp(argv[1], "-bench_convert")) {
+    int ret = convert_benchmark(1920, 1080, 200);
+    if(convert_benchmark(3840, 2160, 50) < 0)
+      ret = -1;
+    return ret < 0 ? 1 : 0;
+  }
+  probe_cache_dir = probe_cache_default_dir();
+  // Register all formats and codecs
+  //av_register_all();
+
+  if(SDL_Init(SDL_INIT_VIDEO | SDL_INIT_AUDIO | SDL_INIT_TIMER)) {
+    fprintf(stderr, "Could not initialize SDL - %s\n", SDL_GetError());
+    exit(1);
+  }
+
+  /* options apply to every file wherever they are given, and are all
+     set before the first player's threads start reading them */
+  for(i = 1; i < argc; i++) {
+    if(!strcmp(argv[i], "-audio_ahead") && i + 1 < argc) {
+      audio_ahead_ms = FFMAX(atoi(argv[++i]), 1);
+      continue;
+    }
+    if(!strcmp(argv[i], "-pictq") && i + 1 < argc) {
+      pictq_depth = av_clip(atoi(argv[++i]), 1, VIDEO_PICTURE_QUEUE_MAX);
+      continue;
+    }
+    if(!strcmp(argv[i], "-noframedrop")) {
+      framedrop = 0;
+      continue;
+    }
+    if(!strcmp(argv[i], "-threads") && i + 1 < argc) {
+      decoder_threads = FFMAX(atoi(argv[++i]), 0);
+      continue;
+    }
+    if(!strcmp(argv[i], "-autothreads")) {
+      autothreads = 1;
+      continue;
+    }
+    if(!strcmp(argv[i], "-sync") && i + 1 < argc) {
+      i++;
+      if(!strcmp(argv[i], "audio"))
+        sync_type = AV_SYNC_AUDIO_MASTER;
+      else if(!strcmp(argv[i], "video"))
+        sync_type = AV_SYNC_VIDEO_MASTER;
+      else
+        fprintf(stderr, "Unknown -sync %s, expected audio or video\n", argv[i]);
+      continue;
+    }
+    if(!strcmp(argv[i], "-noskip")) {
+      decoder_skip = 0;
+      continue;
+    }
+    if(!strcmp(argv[i], "-scale_threads") && i + 1 < argc) {
+      scale_threads = FFMAX(atoi(argv[++i]), 0);
+      continue;
+    }
+    if(!strcmp(argv[i], "-probesize") && i + 1 < argc) {
+      probesize = FFMAX(strtoll(argv[++i], NULL, 10), 0);
+      continue;
+    }
+    if(!strcmp(argv[i], "-analyzeduration") && i + 1 < argc) {
+      analyzeduration = FFMAX(strtoll(argv[++i], NULL, 10), 0);
+      continue;
+    }
+    if(!strcmp(argv[i], "-probe_cache") && i + 1 < argc) {
+      probe_cache_dir = argv[++i];
+      continue;
+    }
+    if(!strcmp(argv[i], "-exact_seek")) {
+      exact_seek = 1;
+      continue;
+    }
+    if(!strcmp(argv[i], "-noindex")) {
+      keyframe_indexing = 0;
+      continue;
+    }
+    if(!strcmp(argv[i], "-noprobecache")) {
+      use_probe_cache = 0;
+      continue;
+    }
+    if(!strcmp(argv[i], "-readahead") && i + 1 < argc) {
+      readahead_blocks = FFMAX(atoi(argv[++i]), 0);
+      continue;
+    }
+    if(!strcmp(argv[i], "-io_latency") && i + 1 < argc) {
+      /* without -readahead this measures plain synchronous reads */
+      io_latency_us = FFMAX(atoi(argv[++i]), 0) * 1000;
+      if(readahead_blocks < 0)
+        readahead_blocks = 0;
+      continue;
+    }
+    if(!strcmp(argv[i], "-nommap")) {
+      use_mmap = 0;
+      continue;
+    }
+    if(!strcmp(argv[i], "-novsync")) {
+      vsync = 0;
+      continue;
+    }
+    if(nb_files == MAX_PLAYERS) {
+      fprintf(stderr, "At most %d files can be played at once\n", MAX_PLAYERS);
+      continue;
+    }
+    files[nb_files++] = argv[i];
+  }
+
+  /* all players present from this thread, and a vsynced present waits
+     for the next vblank: with several windows each would only get its
+     share of the display's refresh rate */
+  if(nb_files > 1)
+    vsync = 0;
+
+  /* every file gets its own player, window and threads */
+  for(i = 0; i < nb_files; i++) {
+    is = stream_open(files[i]);
+    if(is) {
+      players[nb_players++] = is;
+    }
+  }
+  if(!nb_players) {
+    SDL_Quit();
+    return -1;
+  }
+  SDL_AddTimer(STATS_INTERVAL, sdl_stats_timer_cb, NULL);
+
+  while(nb_players > 0) {
     double incr, pos;
-    SDL_WaitEvent(&event);
+    if(!SDL_WaitEventTimeout(&event, video_present_timeout(players, nb_players)))
+      event.type = SDL_FIRSTEVENT; /* a picture is due */
     switch(event.type) {
     case SDL_KEYDOWN:
+      is = find_player(players, nb_players, NULL, event.key.windowID);
+      if(!is)
+    break;
       switch(event.key.keysym.sym) {
       case SDLK_LEFT:
     incr = -10.0;
@@ -1203,38 +2946,55 @@ int main(int argc, char *argv[]) {
     incr = -60.0;
     goto do_seek;
       do_seek:
-    if(global_video_state) {
-      pos = get_master_clock(global_video_state);
-      pos += incr;
-      stream_seek(global_video_state, (int64_t)(pos * AV_TIME_BASE), incr);
-    }
+    pos = get_seek_base(is);
+    pos += incr;
+    stream_seek(is, (int64_t)(pos * AV_TIME_BASE), incr);
+    break;
+      case SDLK_p:
+      case SDLK_SPACE:
+    toggle_pause(is);
     break;
       default:
     break;
       }
       break;
+    case SDL_WINDOWEVENT:
+      if(event.window.event == SDL_WINDOWEVENT_CLOSE) {
+    is = find_player(players, nb_players, NULL, event.window.windowID);
+    if(is)
+      nb_players = remove_player(players, nb_players, is);
+      } else if(event.window.event == SDL_WINDOWEVENT_SIZE_CHANGED) {
+    /* picked up by queue_picture for the next frame */
+    is = find_player(players, nb_players, NULL, event.window.windowID);
+    if(is) {
+      is->window_w = event.window.data1;
+      is->window_h = event.window.data2;
+    }
+      }
+      break;
+    case FF_REFRESH_EVENT:
+      is = find_player(players, nb_players, (VideoState *)event.user.data1, 0);
+      if(is)
+        video_present(is, 1);
+      break;
     case FF_QUIT_EVENT:
-    case SDL_QUIT:
-      is->quit = 1;
-      /*
-       * If the video has finished playing, then both the picture and
-       * audio queues are waiting for more data.  Make them stop
-       * waiting and terminate normally.
-       */
-      SDL_CondSignal(is->audioq.cond);
-      SDL_CondSignal(is->videoq.cond);
-      SDL_Quit();
-      exit(0);
+      nb_players = remove_player(players, nb_players,
+                                 (VideoState *)event.user.data1);
       break;
-    case FF_ALLOC_EVENT:
-      alloc_picture(event.user.data1);
+    case SDL_QUIT:
+      while(nb_players > 0)
+    nb_players = remove_player(players, nb_players, players[0]);
       break;
-    case FF_REFRESH_EVENT:
-      video_refresh_timer(event.user.data1);
+    case FF_STATS_EVENT:
+      for(i = 0; i < nb_players; i++)
+    print_stats(players[i]);
       break;
     default:
       break;
     }
+    for(i = 0; i < nb_players; i++)
+      video_present(players[i], 0);
   }
+  SDL_Quit();
   return 0;
 }
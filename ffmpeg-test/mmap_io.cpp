@@ -0,0 +1,233 @@
+// Memory-mapped input, see mmap_io.h.
+//
+// The whole file is mapped read-only once. Reads are a memcpy out of the
+// mapping, and the kernel is asked to fault in a window ahead of the read
+// position so the copies rarely wait on the disk. avio_read hands reads
+// larger than the context buffer straight to read_packet, so with a small
+// buffer packet payloads are copied once, from the mapping into the
+// packet, and only the demuxer's header parsing goes through the buffer.
+
+#include "mmap_io.h"
+
+extern "C"
+{
+#include <libavutil/avstring.h>
+#include <libavutil/common.h>
+#include <libavutil/error.h>
+#include <libavutil/mem.h>
+}
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <atomic>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#define MMAP_IO_BUFFER_SIZE 4096 /* small, so packet reads bypass it */
+#define MMAP_IO_WINDOW (8 * 1024 * 1024) /* faulted in ahead of reads */
+
+typedef struct MmapFile {
+  const uint8_t *data;
+  int64_t size;
+  int64_t pos;
+  int64_t advised_start, advised_end; /* window last handed to the kernel */
+  std::atomic<int64_t> buffered, direct; /* see mmap_io_stats */
+  AVIOContext *pb;
+#ifdef _WIN32
+  HANDLE file, mapping;
+#endif
+} MmapFile;
+
+/* Ask for the window starting at pos unless most of it is still ahead
+   of us from last time. */
+static void mmap_file_advise(MmapFile *mf, int64_t pos) {
+  int64_t start, len;
+
+  if(pos >= mf->advised_start &&
+     pos + MMAP_IO_WINDOW / 2 <= mf->advised_end)
+    return;
+  start = pos & ~(int64_t)(4096 - 1);
+  len = FFMIN((int64_t)MMAP_IO_WINDOW, mf->size - start);
+  if(len <= 0)
+    return;
+#ifdef _WIN32
+#if defined(_WIN32_WINNT) && _WIN32_WINNT >= 0x0602
+  {
+    WIN32_MEMORY_RANGE_ENTRY range;
+    range.VirtualAddress = (PVOID)(mf->data + start);
+    range.NumberOfBytes = (SIZE_T)len;
+    PrefetchVirtualMemory(GetCurrentProcess(), 1, &range, 0);
+  }
+#endif
+#else
+  madvise((void *)(mf->data + start), (size_t)len, MADV_WILLNEED);
+#endif
+  mf->advised_start = start;
+  mf->advised_end = start + len;
+}
+
+static int mmap_file_read(void *opaque, uint8_t *buf, int buf_size) {
+  MmapFile *mf = (MmapFile *)opaque;
+  int64_t left = mf->size - mf->pos;
+  int n;
+
+  if(left <= 0)
+    return AVERROR_EOF;
+  n = (int)FFMIN((int64_t)buf_size, left);
+  mmap_file_advise(mf, mf->pos);
+  memcpy(buf, mf->data + mf->pos, n);
+  mf->pos += n;
+  /* fill_buffer may append behind what is already buffered */
+  if(buf >= mf->pb->buffer && buf < mf->pb->buffer + mf->pb->buffer_size)
+    mf->buffered += n;
+  else
+    mf->direct += n;
+  return n;
+}
+
+static int64_t mmap_file_seek(void *opaque, int64_t offset, int whence) {
+  MmapFile *mf = (MmapFile *)opaque;
+  int64_t pos;
+
+  switch(whence & ~AVSEEK_FORCE) {
+  case AVSEEK_SIZE:
+    return mf->size;
+  case SEEK_SET:
+    pos = offset;
+    break;
+  case SEEK_CUR:
+    pos = mf->pos + offset;
+    break;
+  case SEEK_END:
+    pos = mf->size + offset;
+    break;
+  default:
+    return AVERROR(EINVAL);
+  }
+  if(pos < 0 || pos > mf->size)
+    return AVERROR(EINVAL);
+  mf->pos = pos;
+  return pos;
+}
+
+static void mmap_file_unmap(MmapFile *mf) {
+#ifdef _WIN32
+  if(mf->data)
+    UnmapViewOfFile(mf->data);
+  if(mf->mapping)
+    CloseHandle(mf->mapping);
+  if(mf->file != INVALID_HANDLE_VALUE)
+    CloseHandle(mf->file);
+#else
+  if(mf->data)
+    munmap((void *)mf->data, (size_t)mf->size);
+#endif
+}
+
+static int mmap_file_map(MmapFile *mf, const char *path) {
+#ifdef _WIN32
+  LARGE_INTEGER size;
+
+  mf->file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL,
+                         OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+  if(mf->file == INVALID_HANDLE_VALUE)
+    return AVERROR(ENOENT);
+  if(!GetFileSizeEx(mf->file, &size) || size.QuadPart <= 0 ||
+     (uint64_t)size.QuadPart > (uint64_t)SIZE_MAX)
+    return AVERROR(EINVAL);
+  mf->size = size.QuadPart;
+  mf->mapping = CreateFileMappingA(mf->file, NULL, PAGE_READONLY, 0, 0, NULL);
+  if(!mf->mapping)
+    return AVERROR(ENOMEM);
+  mf->data = (const uint8_t *)MapViewOfFile(mf->mapping, FILE_MAP_READ, 0, 0, 0);
+  if(!mf->data)
+    return AVERROR(ENOMEM);
+#else
+  struct stat st;
+  void *data;
+  int fd = open(path, O_RDONLY);
+
+  if(fd < 0)
+    return AVERROR(errno);
+  if(fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_size <= 0 ||
+     (uint64_t)st.st_size > (uint64_t)SIZE_MAX) {
+    close(fd);
+    return AVERROR(EINVAL);
+  }
+  data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  /* the mapping keeps the file alive */
+  close(fd);
+  if(data == MAP_FAILED)
+    return AVERROR(ENOMEM);
+  mf->data = (const uint8_t *)data;
+  mf->size = st.st_size;
+  madvise(data, (size_t)st.st_size, MADV_SEQUENTIAL);
+#endif
+  return 0;
+}
+
+int mmap_io_open(AVIOContext **pb, const char *filename) {
+  const char *protocol = avio_find_protocol_name(filename);
+  const char *path = filename;
+  MmapFile *mf;
+  uint8_t *buffer;
+  int ret;
+
+  *pb = NULL;
+  if(!protocol || strcmp(protocol, "file"))
+    return AVERROR(ENOSYS);
+  av_strstart(filename, "file:", &path);
+
+  mf = (MmapFile *)av_mallocz(sizeof(*mf));
+  if(!mf)
+    return AVERROR(ENOMEM);
+#ifdef _WIN32
+  mf->file = INVALID_HANDLE_VALUE;
+#endif
+  ret = mmap_file_map(mf, path);
+  if(ret < 0) {
+    mmap_file_unmap(mf);
+    av_free(mf);
+    return ret;
+  }
+
+  buffer = (uint8_t *)av_malloc(MMAP_IO_BUFFER_SIZE);
+  if(buffer)
+    mf->pb = avio_alloc_context(buffer, MMAP_IO_BUFFER_SIZE, 0, mf,
+                                mmap_file_read, NULL, mmap_file_seek);
+  if(!mf->pb) {
+    av_free(buffer);
+    mmap_file_unmap(mf);
+    av_free(mf);
+    return AVERROR(ENOMEM);
+  }
+  mf->pb->seekable = AVIO_SEEKABLE_NORMAL;
+  *pb = mf->pb;
+  return 0;
+}
+
+void mmap_io_close(AVIOContext **pb) {
+  MmapFile *mf;
+
+  if(!*pb)
+    return;
+  mf = (MmapFile *)(*pb)->opaque;
+  av_freep(&(*pb)->buffer);
+  avio_context_free(pb);
+  mmap_file_unmap(mf);
+  av_free(mf);
+}
+
+void mmap_io_stats(AVIOContext *pb, int64_t *buffered, int64_t *direct) {
+  MmapFile *mf = (MmapFile *)pb->opaque;
+
+  *buffered = mf->buffered;
+  *direct = mf->direct;
+}
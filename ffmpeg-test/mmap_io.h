@@ -0,0 +1,26 @@
+#ifndef MMAP_IO_H
+#define MMAP_IO_H
+
+// AVIOContext reading a local file straight out of a memory mapping, so
+// the demuxer is fed from the page cache without a read() per buffer.
+// Anything that is not a plain local file is left to avio_open2.
+
+extern "C"
+{
+#include <libavformat/avio.h>
+}
+#include <stdint.h>
+
+/* Map filename and wrap it in *pb. Returns a negative AVERROR if the
+   file is not local or could not be mapped, the caller then falls back
+   to the normal protocols. */
+int mmap_io_open(AVIOContext **pb, const char *filename);
+
+/* Unmaps and frees a context from mmap_io_open, sets *pb to NULL. */
+void mmap_io_close(AVIOContext **pb);
+
+/* Bytes that went through the context's own buffer, and bytes that
+   avio_read handed straight to the caller's memory (packet data). */
+void mmap_io_stats(AVIOContext *pb, int64_t *buffered, int64_t *direct);
+
+#endif // MMAP_IO_H
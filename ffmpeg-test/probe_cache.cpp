@@ -0,0 +1,393 @@
+// Probe-result cache, see probe_cache.h.
+//
+// One small text file per media file, named after a hash of its key. The
+// entry only ever fills in what avformat_open_input left unset, so
+// whatever the container header says still wins; it is the decoding
+// avformat_find_stream_info does for the rest (pixel format, channel
+// layout, frame rate, ...) that the cache saves.
+
+#include "probe_cache.h"
+
+extern "C"
+{
+#include <libavcodec/avcodec.h>
+#include <libavutil/avstring.h>
+#include <libavutil/channel_layout.h>
+#include <libavutil/mem.h>
+}
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#ifdef _WIN32
+#include <direct.h>
+#define probe_mkdir(path) _mkdir(path)
+#else
+#define probe_mkdir(path) mkdir(path, 0755)
+#endif
+
+#define PROBE_CACHE_MAGIC "ffmpeg-test-probe 1"
+#define PROBE_HEAD_SIZE (64 * 1024) /* bytes hashed into the key */
+
+typedef struct ProbeStream {
+  AVCodecParameters *par;
+  AVRational avg_frame_rate, r_frame_rate;
+} ProbeStream;
+
+static uint64_t fnv1a(uint64_t hash, const void *data, size_t size) {
+  const uint8_t *p = (const uint8_t *)data;
+
+  while(size--) {
+    hash ^= *p++;
+    hash *= 0x100000001b3ULL;
+  }
+  return hash;
+}
+
+int probe_cache_key(ProbeKey *key, const char *filename) {
+  const char *protocol = avio_find_protocol_name(filename);
+  const char *path = filename;
+  uint8_t *head;
+  size_t n;
+  FILE *f;
+#ifdef _WIN32
+  struct _stat64 st;
+#else
+  struct stat st;
+#endif
+
+  if(!protocol || strcmp(protocol, "file"))
+    return AVERROR(ENOSYS);
+  av_strstart(filename, "file:", &path);
+#ifdef _WIN32
+  if(_stat64(path, &st) < 0)
+#else
+  if(stat(path, &st) < 0)
+#endif
+    return AVERROR(errno);
+
+  memset(key, 0, sizeof(*key));
+  av_strlcpy(key->path, path, sizeof(key->path));
+  key->size = st.st_size;
+  key->mtime = st.st_mtime;
+
+  /* catches files rewritten within the mtime granularity */
+  head = (uint8_t *)av_malloc(PROBE_HEAD_SIZE);
+  if(!head)
+    return AVERROR(ENOMEM);
+  f = fopen(path, "rb");
+  if(!f) {
+    av_free(head);
+    return AVERROR(errno);
+  }
+  n = fread(head, 1, PROBE_HEAD_SIZE, f);
+  fclose(f);
+  key->head_hash = fnv1a(0xcbf29ce484222325ULL, head, n);
+  av_free(head);
+
+  key->id = fnv1a(0xcbf29ce484222325ULL, key->path, strlen(key->path));
+  key->id = fnv1a(key->id, &key->size, sizeof(key->size));
+  key->id = fnv1a(key->id, &key->mtime, sizeof(key->mtime));
+  key->id = fnv1a(key->id, &key->head_hash, sizeof(key->head_hash));
+  return 0;
+}
+
+const char *probe_cache_default_dir(void) {
+  static char dir[1024];
+  const char *base;
+
+  if(dir[0])
+    return dir;
+#ifdef _WIN32
+  base = getenv("LOCALAPPDATA");
+  if(base) {
+    snprintf(dir, sizeof(dir), "%s\\ffmpeg-test", base);
+    return dir;
+  }
+#else
+  base = getenv("XDG_CACHE_HOME");
+  if(base && base[0]) {
+    snprintf(dir, sizeof(dir), "%s/ffmpeg-test", base);
+    return dir;
+  }
+  base = getenv("HOME");
+  if(base) {
+    snprintf(dir, sizeof(dir), "%s/.cache/ffmpeg-test", base);
+    return dir;
+  }
+#endif
+  av_strlcpy(dir, "probe-cache", sizeof(dir));
+  return dir;
+}
+
+void probe_cache_path(char *buf, size_t size, const char *dir,
+                      const ProbeKey *key, const char *ext) {
+  snprintf(buf, size, "%s/%016" PRIx64 ".%s", dir, key->id, ext);
+}
+
+/* mkdir -p, errors show up when the entry is written */
+static void make_dirs(const char *dir) {
+  char path[1024];
+  char *p;
+
+  av_strlcpy(path, dir, sizeof(path));
+  for(p = path + 1; *p; p++) {
+    if(*p == '/' || *p == '\\') {
+      char c = *p;
+      *p = 0;
+      probe_mkdir(path);
+      *p = c;
+    }
+  }
+  probe_mkdir(path);
+}
+
+static void probe_streams_free(ProbeStream *streams, int nb_streams) {
+  int i;
+
+  for(i = 0; i < nb_streams; i++)
+    avcodec_parameters_free(&streams[i].par);
+  av_free(streams);
+}
+
+static int read_stream(FILE *f, ProbeStream *ps) {
+  AVCodecParameters *par = ps->par;
+  int type, codec_id, format, field_order, color_range, color_primaries;
+  int color_trc, color_space, chroma_location, nb_channels, extradata_size;
+  unsigned codec_tag, byte;
+  uint64_t channel_mask;
+  int i;
+
+  if(fscanf(f, " stream %d %u %d %" SCNd64 " %d %d %d %d %d %d %d %d %d %d %d %d %d"
+            " %d %" SCNu64 " %d %d %d %d %d %d %d %d %d",
+            &type, &codec_tag, &codec_id, &par->bit_rate, &format,
+            &par->profile, &par->level, &par->width, &par->height,
+            &par->sample_aspect_ratio.num, &par->sample_aspect_ratio.den,
+            &field_order, &color_range, &color_primaries, &color_trc,
+            &color_space, &chroma_location, &nb_channels, &channel_mask,
+            &par->sample_rate, &par->block_align, &par->frame_size,
+            &par->video_delay,
+            &ps->avg_frame_rate.num, &ps->avg_frame_rate.den,
+            &ps->r_frame_rate.num, &ps->r_frame_rate.den,
+            &extradata_size) != 28)
+    return AVERROR_INVALIDDATA;
+  par->codec_type = (enum AVMediaType)type;
+  par->codec_tag = codec_tag;
+  par->codec_id = (enum AVCodecID)codec_id;
+  par->format = format;
+  par->field_order = (enum AVFieldOrder)field_order;
+  par->color_range = (enum AVColorRange)color_range;
+  par->color_primaries = (enum AVColorPrimaries)color_primaries;
+  par->color_trc = (enum AVColorTransferCharacteristic)color_trc;
+  par->color_space = (enum AVColorSpace)color_space;
+  par->chroma_location = (enum AVChromaLocation)chroma_location;
+  if(nb_channels > 0) {
+    if(channel_mask)
+      av_channel_layout_from_mask(&par->ch_layout, channel_mask);
+    else
+      av_channel_layout_default(&par->ch_layout, nb_channels);
+  }
+  if(extradata_size < 0 || extradata_size > (1 << 24))
+    return AVERROR_INVALIDDATA;
+  if(extradata_size > 0) {
+    par->extradata = (uint8_t *)av_mallocz(extradata_size + AV_INPUT_BUFFER_PADDING_SIZE);
+    if(!par->extradata)
+      return AVERROR(ENOMEM);
+    par->extradata_size = extradata_size;
+    for(i = 0; i < extradata_size; i++) {
+      if(fscanf(f, "%2x", &byte) != 1)
+        return AVERROR_INVALIDDATA;
+      par->extradata[i] = byte;
+    }
+  }
+  return 0;
+}
+
+/* Only what the demuxer could not tell from the header. */
+static void fill_stream(AVStream *st, const ProbeStream *ps) {
+  AVCodecParameters *par = st->codecpar;
+  const AVCodecParameters *c = ps->par;
+
+  if(!par->codec_tag)
+    par->codec_tag = c->codec_tag;
+  if(!par->bit_rate)
+    par->bit_rate = c->bit_rate;
+  if(par->format < 0)
+    par->format = c->format;
+  if(par->profile == FF_PROFILE_UNKNOWN)
+    par->profile = c->profile;
+  if(par->level == FF_LEVEL_UNKNOWN)
+    par->level = c->level;
+  if(!par->width || !par->height) {
+    par->width = c->width;
+    par->height = c->height;
+  }
+  if(!par->sample_aspect_ratio.num)
+    par->sample_aspect_ratio = c->sample_aspect_ratio;
+  if(par->field_order == AV_FIELD_UNKNOWN)
+    par->field_order = c->field_order;
+  if(par->color_range == AVCOL_RANGE_UNSPECIFIED)
+    par->color_range = c->color_range;
+  if(par->color_primaries == AVCOL_PRI_UNSPECIFIED)
+    par->color_primaries = c->color_primaries;
+  if(par->color_trc == AVCOL_TRC_UNSPECIFIED)
+    par->color_trc = c->color_trc;
+  if(par->color_space == AVCOL_SPC_UNSPECIFIED)
+    par->color_space = c->color_space;
+  if(par->chroma_location == AVCHROMA_LOC_UNSPECIFIED)
+    par->chroma_location = c->chroma_location;
+  if(!par->video_delay)
+    par->video_delay = c->video_delay;
+  if(!par->ch_layout.nb_channels && c->ch_layout.nb_channels) {
+    av_channel_layout_copy(&par->ch_layout, &c->ch_layout);
+  }
+  if(!par->sample_rate)
+    par->sample_rate = c->sample_rate;
+  if(!par->block_align)
+    par->block_align = c->block_align;
+  if(!par->frame_size)
+    par->frame_size = c->frame_size;
+  if(!par->extradata && c->extradata_size) {
+    par->extradata = (uint8_t *)av_mallocz(c->extradata_size + AV_INPUT_BUFFER_PADDING_SIZE);
+    if(par->extradata) {
+      memcpy(par->extradata, c->extradata, c->extradata_size);
+      par->extradata_size = c->extradata_size;
+    }
+  }
+  if(!st->avg_frame_rate.num)
+    st->avg_frame_rate = ps->avg_frame_rate;
+  if(!st->r_frame_rate.num)
+    st->r_frame_rate = ps->r_frame_rate;
+}
+
+int probe_cache_load(const char *dir, const ProbeKey *key, AVFormatContext *fmt) {
+  char path[1200], line[1200], format_name[256];
+  int64_t size, mtime, start_time, duration, bit_rate;
+  uint64_t head_hash;
+  ProbeStream *streams = NULL;
+  int nb_streams = 0, ret = 0, i, len;
+  FILE *f;
+
+  probe_cache_path(path, sizeof(path), dir, key, "probe");
+  f = fopen(path, "r");
+  if(!f)
+    return 0;
+
+  if(!fgets(line, sizeof(line), f) || strncmp(line, PROBE_CACHE_MAGIC, strlen(PROBE_CACHE_MAGIC)))
+    goto end;
+  if(fscanf(f, "key %" SCNd64 " %" SCNd64 " %" SCNx64 "\n", &size, &mtime, &head_hash) != 3 ||
+     size != key->size || mtime != key->mtime || head_hash != key->head_hash)
+    goto end;
+  /* the id is a hash, the path settles collisions */
+  if(!fgets(line, sizeof(line), f) || strncmp(line, "path ", 5))
+    goto end;
+  len = strlen(line);
+  if(len && line[len - 1] == '\n')
+    line[len - 1] = 0;
+  if(strcmp(line + 5, key->path))
+    goto end;
+  if(fscanf(f, "format %255s %" SCNd64 " %" SCNd64 " %" SCNd64,
+            format_name, &start_time, &duration, &bit_rate) != 4 ||
+     strcmp(format_name, fmt->iformat->name))
+    goto end;
+  /* streams the demuxer only finds while probing (MPEG-TS) are not
+     there yet, such files need the full probe */
+  if(fscanf(f, " streams %d", &nb_streams) != 1 ||
+     nb_streams != (int)fmt->nb_streams || nb_streams <= 0)
+    goto end;
+
+  streams = (ProbeStream *)av_calloc(nb_streams, sizeof(*streams));
+  if(!streams)
+    goto end;
+  for(i = 0; i < nb_streams; i++) {
+    AVCodecParameters *par = fmt->streams[i]->codecpar;
+
+    streams[i].par = avcodec_parameters_alloc();
+    if(!streams[i].par || read_stream(f, &streams[i]) < 0)
+      goto end;
+    if(streams[i].par->codec_type != par->codec_type ||
+       streams[i].par->codec_id != par->codec_id)
+      goto end;
+  }
+
+  for(i = 0; i < nb_streams; i++)
+    fill_stream(fmt->streams[i], &streams[i]);
+  if(fmt->start_time == AV_NOPTS_VALUE)
+    fmt->start_time = start_time;
+  if(fmt->duration == AV_NOPTS_VALUE)
+    fmt->duration = duration;
+  if(!fmt->bit_rate)
+    fmt->bit_rate = bit_rate;
+  ret = 1;
+
+ end:
+  if(streams)
+    probe_streams_free(streams, nb_streams);
+  fclose(f);
+  return ret;
+}
+
+int probe_cache_store(const char *dir, const ProbeKey *key, AVFormatContext *fmt) {
+  char path[1200], tmp[1200];
+  unsigned i;
+  int j;
+  FILE *f;
+
+  make_dirs(dir);
+  probe_cache_path(path, sizeof(path), dir, key, "probe");
+  probe_cache_path(tmp, sizeof(tmp), dir, key, "probe.tmp");
+  f = fopen(tmp, "w");
+  if(!f) {
+    fprintf(stderr, "Could not write probe cache entry %s\n", tmp);
+    return AVERROR(errno);
+  }
+
+  fprintf(f, "%s\n", PROBE_CACHE_MAGIC);
+  fprintf(f, "key %" PRId64 " %" PRId64 " %" PRIx64 "\n",
+          key->size, key->mtime, key->head_hash);
+  fprintf(f, "path %s\n", key->path);
+  fprintf(f, "format %s %" PRId64 " %" PRId64 " %" PRId64 "\n",
+          fmt->iformat->name, fmt->start_time, fmt->duration, fmt->bit_rate);
+  fprintf(f, "streams %u\n", fmt->nb_streams);
+  for(i = 0; i < fmt->nb_streams; i++) {
+    AVStream *st = fmt->streams[i];
+    AVCodecParameters *par = st->codecpar;
+
+    fprintf(f, "stream %d %u %d %" PRId64 " %d %d %d %d %d %d %d %d %d %d %d %d %d"
+            " %d %" PRIu64 " %d %d %d %d %d %d %d %d %d\n",
+            par->codec_type, par->codec_tag, par->codec_id, par->bit_rate,
+            par->format, par->profile, par->level, par->width, par->height,
+            par->sample_aspect_ratio.num, par->sample_aspect_ratio.den,
+            par->field_order, par->color_range, par->color_primaries,
+            par->color_trc, par->color_space, par->chroma_location,
+            par->ch_layout.nb_channels,
+            par->ch_layout.order == AV_CHANNEL_ORDER_NATIVE ? par->ch_layout.u.mask : 0,
+            par->sample_rate, par->block_align, par->frame_size,
+            par->video_delay,
+            st->avg_frame_rate.num, st->avg_frame_rate.den,
+            st->r_frame_rate.num, st->r_frame_rate.den,
+            par->extradata_size);
+    if(par->extradata_size > 0) {
+      for(j = 0; j < par->extradata_size; j++)
+        fprintf(f, "%02x", par->extradata[j]);
+      fprintf(f, "\n");
+    }
+  }
+  if(fclose(f) != 0) {
+    remove(tmp);
+    return AVERROR(EIO);
+  }
+  /* readers never see half an entry */
+#ifdef _WIN32
+  remove(path);
+#endif
+  if(rename(tmp, path) < 0) {
+    remove(tmp);
+    return AVERROR(errno);
+  }
+  return 0;
+}
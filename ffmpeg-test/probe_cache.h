@@ -0,0 +1,43 @@
+#ifndef PROBE_CACHE_H
+#define PROBE_CACHE_H
+
+// On-disk cache of what avformat_find_stream_info found out about a file:
+// stream layout and codec parameters. A file is known again by its path,
+// size, modification time and a hash of its first bytes, so a file that
+// is replaced or rewritten in place is probed afresh.
+
+extern "C"
+{
+#include <libavformat/avformat.h>
+}
+#include <stdint.h>
+
+typedef struct ProbeKey {
+  char path[1024];
+  int64_t size;
+  int64_t mtime;
+  uint64_t head_hash;
+  uint64_t id; /* names the cache entry */
+} ProbeKey;
+
+/* Fill key for a local file. Returns a negative AVERROR for anything
+   that is not one, those are never cached. */
+int probe_cache_key(ProbeKey *key, const char *filename);
+
+/* Cache directory used when none is given: the user's cache dir. */
+const char *probe_cache_default_dir(void);
+
+/* Where the file for key with extension ext lives in dir; other data
+   kept per media file (keyframe_index) goes next to the probe entry. */
+void probe_cache_path(char *buf, size_t size, const char *dir,
+                      const ProbeKey *key, const char *ext);
+
+/* Complete the streams avformat_open_input set up from the entry for
+   key. Returns 1 if the entry matched and avformat_find_stream_info can
+   be skipped, 0 if there is no usable entry. */
+int probe_cache_load(const char *dir, const ProbeKey *key, AVFormatContext *fmt);
+
+/* Write the entry for key from a fully probed fmt. */
+int probe_cache_store(const char *dir, const ProbeKey *key, AVFormatContext *fmt);
+
+#endif // PROBE_CACHE_H
@@ -0,0 +1,446 @@
+// Read-ahead input for slow storage, see readahead_io.h.
+//
+// The file is cut into block_size blocks and block n always lives in
+// slot n % nb_blocks, so the window ahead of the cursor is simply the
+// next nb_blocks blocks. Whenever the cursor enters a new block the
+// slots are re-targeted at that window: slots still holding what the
+// window wants are left alone, the others are queued for the workers,
+// which read the queued block nearest to the cursor first. A slot a
+// worker is busy reading is only re-targeted once that read is done, so
+// the data the reader copies from is never written behind its back.
+
+#include "readahead_io.h"
+
+extern "C"
+{
+#include <libavutil/avstring.h>
+#include <libavutil/common.h>
+#include <libavutil/error.h>
+#include <libavutil/mem.h>
+#include <libavutil/time.h>
+
+#include <SDL2/SDL.h>
+#include <SDL2/SDL_thread.h>
+}
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <atomic>
+
+#ifdef _WIN32
+#include <malloc.h>
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#define READAHEAD_MAX_THREADS 4
+#define READAHEAD_BUFFER_SIZE 4096 /* small, so packet reads bypass it */
+#define READAHEAD_ALIGN 4096
+#define READAHEAD_RETRIES 3 /* attempts per block before an error sticks */
+
+enum {
+  BLOCK_EMPTY,
+  BLOCK_QUEUED,
+  BLOCK_READING,
+  BLOCK_DONE,
+};
+
+typedef struct ReadBlock {
+  int64_t offset; /* what data holds, or is being read into */
+  int64_t want;   /* what the window wants here, -1 for nothing */
+  uint8_t *data;
+  int size;       /* once BLOCK_DONE: bytes read, or an AVERROR */
+  int state;
+} ReadBlock;
+
+typedef struct ReadAhead {
+#ifdef _WIN32
+  HANDLE file;
+#else
+  int fd;
+#endif
+  int64_t size;
+  int64_t pos;
+  int block_size, nb_blocks, latency_us;
+  AVIOInterruptCB int_cb;
+  AVIOContext *pb;
+
+  ReadBlock *blocks;
+  int64_t window; /* block the window was last set for, -1 for none */
+  int quit;
+  SDL_mutex *mutex;
+  SDL_cond *work_cond, *done_cond;
+  SDL_Thread *threads[READAHEAD_MAX_THREADS];
+  int nb_threads;
+
+  std::atomic<int64_t> buffered, direct; /* see readahead_io_stats */
+  std::atomic<int> waits;
+  std::atomic<int64_t> wait_time;
+} ReadAhead;
+
+/* Blocks are page aligned, like their offsets in the file, so every
+   pread copies whole pages out of the page cache; av_malloc only
+   guarantees what SIMD needs. */
+static uint8_t *block_alloc(size_t size) {
+  uint8_t *data;
+
+#ifdef _WIN32
+  data = (uint8_t *)_aligned_malloc(size, READAHEAD_ALIGN);
+#else
+  if(posix_memalign((void **)&data, READAHEAD_ALIGN, size))
+    data = NULL;
+#endif
+  return data;
+}
+
+static void block_free(uint8_t *data) {
+#ifdef _WIN32
+  _aligned_free(data);
+#else
+  free(data);
+#endif
+}
+
+/* Positioned read, safe to run from several threads at once. */
+static int file_pread(ReadAhead *ra, uint8_t *buf, int size, int64_t offset) {
+#ifdef _WIN32
+  OVERLAPPED ov;
+  DWORD n = 0;
+  int ret;
+
+  memset(&ov, 0, sizeof(ov));
+  ov.Offset = (DWORD)offset;
+  ov.OffsetHigh = (DWORD)(offset >> 32);
+  ov.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+  if(!ov.hEvent)
+    return AVERROR(ENOMEM);
+  if(!ReadFile(ra->file, buf, size, NULL, &ov) &&
+     GetLastError() != ERROR_IO_PENDING) {
+    ret = GetLastError() == ERROR_HANDLE_EOF ? 0 : AVERROR(EIO);
+  } else if(!GetOverlappedResult(ra->file, &ov, &n, TRUE)) {
+    ret = GetLastError() == ERROR_HANDLE_EOF ? 0 : AVERROR(EIO);
+  } else {
+    ret = (int)n;
+  }
+  CloseHandle(ov.hEvent);
+  return ret;
+#else
+  ssize_t n;
+
+  do {
+    n = pread(ra->fd, buf, size, offset);
+  } while(n < 0 && errno == EINTR);
+  return n < 0 ? AVERROR(errno) : (int)n;
+#endif
+}
+
+/* Called with the mutex held. */
+static void readahead_set_window(ReadAhead *ra, int64_t first) {
+  int k;
+
+  if(first == ra->window)
+    return;
+  ra->window = first;
+  for(k = 0; k < ra->nb_blocks; k++) {
+    int64_t offset = (first + k) * ra->block_size;
+    ReadBlock *b = &ra->blocks[(first + k) % ra->nb_blocks];
+
+    if(offset >= ra->size)
+      offset = -1;
+    if(b->want == offset)
+      continue;
+    b->want = offset;
+    if(b->state != BLOCK_READING) {
+      /* the worker reading it re-queues it when done */
+      b->offset = offset;
+      b->state = offset < 0 ? BLOCK_EMPTY : BLOCK_QUEUED;
+    }
+  }
+  SDL_CondBroadcast(ra->work_cond);
+}
+
+static int readahead_worker(void *arg) {
+  ReadAhead *ra = (ReadAhead *)arg;
+  ReadBlock *b;
+  int64_t offset;
+  int i, size;
+
+  SDL_LockMutex(ra->mutex);
+  while(!ra->quit) {
+    /* nearest to the cursor first */
+    b = NULL;
+    for(i = 0; i < ra->nb_blocks; i++) {
+      ReadBlock *c = &ra->blocks[i];
+      if(c->state == BLOCK_QUEUED && (!b || c->offset < b->offset))
+        b = c;
+    }
+    if(!b) {
+      SDL_CondWait(ra->work_cond, ra->mutex);
+      continue;
+    }
+    b->state = BLOCK_READING;
+    offset = b->offset;
+    SDL_UnlockMutex(ra->mutex);
+
+    /* transient errors are retried here; one that persists is final */
+    for(i = 0; i < READAHEAD_RETRIES; i++) {
+      if(ra->latency_us > 0)
+        av_usleep(ra->latency_us);
+      size = file_pread(ra, b->data, ra->block_size, offset);
+      if(size >= 0)
+        break;
+    }
+
+    SDL_LockMutex(ra->mutex);
+    b->size = size;
+    if(b->want != offset) {
+      /* the window moved on while we were reading */
+      b->offset = b->want;
+      b->state = b->want < 0 ? BLOCK_EMPTY : BLOCK_QUEUED;
+    } else {
+      b->state = BLOCK_DONE;
+      SDL_CondBroadcast(ra->done_cond);
+    }
+  }
+  SDL_UnlockMutex(ra->mutex);
+  return 0;
+}
+
+static int readahead_read(void *opaque, uint8_t *buf, int buf_size) {
+  ReadAhead *ra = (ReadAhead *)opaque;
+  int64_t first, offset, start;
+  ReadBlock *b;
+  int n;
+
+  if(ra->pos >= ra->size)
+    return AVERROR_EOF;
+
+  if(!ra->nb_blocks) {
+    /* no read-ahead: the demuxer waits for every read */
+    start = av_gettime_relative();
+    if(ra->latency_us > 0)
+      av_usleep(ra->latency_us);
+    n = file_pread(ra, buf, buf_size, ra->pos);
+    ra->waits++;
+    ra->wait_time += av_gettime_relative() - start;
+  } else {
+    first = ra->pos / ra->block_size;
+    offset = first * ra->block_size;
+    b = &ra->blocks[first % ra->nb_blocks];
+
+    SDL_LockMutex(ra->mutex);
+    readahead_set_window(ra, first);
+    if(b->state != BLOCK_DONE || b->offset != offset) {
+      ra->waits++;
+      start = av_gettime_relative();
+      while(b->state != BLOCK_DONE || b->offset != offset) {
+        if(ra->int_cb.callback && ra->int_cb.callback(ra->int_cb.opaque)) {
+          SDL_UnlockMutex(ra->mutex);
+          return AVERROR_EXIT;
+        }
+        SDL_CondWaitTimeout(ra->done_cond, ra->mutex, 100);
+      }
+      ra->wait_time += av_gettime_relative() - start;
+    }
+    if(b->size < 0) {
+      /* the worker has already retried; the AVIOContext keeps the error */
+      n = b->size;
+      SDL_UnlockMutex(ra->mutex);
+      return n;
+    }
+    SDL_UnlockMutex(ra->mutex);
+
+    /* the block can't be re-targeted until we move the window */
+    n = (int)FFMIN((int64_t)buf_size, offset + b->size - ra->pos);
+    if(n <= 0)
+      return AVERROR_EOF;
+    memcpy(buf, b->data + (ra->pos - offset), n);
+  }
+  if(n <= 0)
+    return n < 0 ? n : AVERROR_EOF;
+  ra->pos += n;
+  if(buf >= ra->pb->buffer && buf < ra->pb->buffer + ra->pb->buffer_size)
+    ra->buffered += n;
+  else
+    ra->direct += n;
+  return n;
+}
+
+/* Seeking only moves the cursor, the next read re-targets the window. */
+static int64_t readahead_seek(void *opaque, int64_t offset, int whence) {
+  ReadAhead *ra = (ReadAhead *)opaque;
+  int64_t pos;
+
+  switch(whence & ~AVSEEK_FORCE) {
+  case AVSEEK_SIZE:
+    return ra->size;
+  case SEEK_SET:
+    pos = offset;
+    break;
+  case SEEK_CUR:
+    pos = ra->pos + offset;
+    break;
+  case SEEK_END:
+    pos = ra->size + offset;
+    break;
+  default:
+    return AVERROR(EINVAL);
+  }
+  if(pos < 0 || pos > ra->size)
+    return AVERROR(EINVAL);
+  ra->pos = pos;
+  return pos;
+}
+
+static void readahead_free(ReadAhead *ra) {
+  int i;
+
+  if(ra->mutex) {
+    SDL_LockMutex(ra->mutex);
+    ra->quit = 1;
+    SDL_CondBroadcast(ra->work_cond);
+    SDL_UnlockMutex(ra->mutex);
+  }
+  for(i = 0; i < ra->nb_threads; i++)
+    SDL_WaitThread(ra->threads[i], NULL);
+  if(ra->blocks) {
+    for(i = 0; i < ra->nb_blocks; i++)
+      block_free(ra->blocks[i].data);
+    av_free(ra->blocks);
+  }
+  SDL_DestroyCond(ra->work_cond);
+  SDL_DestroyCond(ra->done_cond);
+  SDL_DestroyMutex(ra->mutex);
+#ifdef _WIN32
+  if(ra->file != INVALID_HANDLE_VALUE)
+    CloseHandle(ra->file);
+#else
+  if(ra->fd >= 0)
+    close(ra->fd);
+#endif
+  av_free(ra);
+}
+
+static int readahead_file_open(ReadAhead *ra, const char *path) {
+#ifdef _WIN32
+  LARGE_INTEGER size;
+
+  ra->file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL,
+                         OPEN_EXISTING, FILE_FLAG_OVERLAPPED, NULL);
+  if(ra->file == INVALID_HANDLE_VALUE)
+    return AVERROR(ENOENT);
+  if(!GetFileSizeEx(ra->file, &size))
+    return AVERROR(EIO);
+  ra->size = size.QuadPart;
+#else
+  struct stat st;
+
+  ra->fd = open(path, O_RDONLY);
+  if(ra->fd < 0)
+    return AVERROR(errno);
+  if(fstat(ra->fd, &st) < 0 || !S_ISREG(st.st_mode))
+    return AVERROR(EINVAL);
+  ra->size = st.st_size;
+#endif
+  return 0;
+}
+
+int readahead_io_open(AVIOContext **pb, const char *filename,
+                      int nb_blocks, int block_size, int latency_us,
+                      const AVIOInterruptCB *int_cb) {
+  const char *protocol = avio_find_protocol_name(filename);
+  const char *path = filename;
+  ReadAhead *ra;
+  uint8_t *buffer;
+  int i, ret;
+
+  *pb = NULL;
+  if(!protocol || strcmp(protocol, "file"))
+    return AVERROR(ENOSYS);
+  av_strstart(filename, "file:", &path);
+
+  ra = (ReadAhead *)av_mallocz(sizeof(*ra));
+  if(!ra)
+    return AVERROR(ENOMEM);
+#ifdef _WIN32
+  ra->file = INVALID_HANDLE_VALUE;
+#else
+  ra->fd = -1;
+#endif
+  ra->nb_blocks = FFMAX(nb_blocks, 0);
+  ra->block_size = FFALIGN(FFMAX(block_size, READAHEAD_ALIGN), READAHEAD_ALIGN);
+  ra->latency_us = latency_us;
+  ra->window = -1;
+  if(int_cb)
+    ra->int_cb = *int_cb;
+  ret = readahead_file_open(ra, path);
+  if(ret < 0)
+    goto fail;
+
+  if(ra->nb_blocks) {
+    ret = AVERROR(ENOMEM);
+    ra->mutex = SDL_CreateMutex();
+    ra->work_cond = SDL_CreateCond();
+    ra->done_cond = SDL_CreateCond();
+    ra->blocks = (ReadBlock *)av_calloc(ra->nb_blocks, sizeof(*ra->blocks));
+    if(!ra->mutex || !ra->work_cond || !ra->done_cond || !ra->blocks)
+      goto fail;
+    for(i = 0; i < ra->nb_blocks; i++) {
+      ReadBlock *b = &ra->blocks[i];
+      /* aligned both in memory and in the file, as unbuffered I/O wants */
+      b->data = block_alloc(ra->block_size);
+      if(!b->data)
+        goto fail;
+      b->offset = b->want = -1;
+      b->state = BLOCK_EMPTY;
+    }
+    for(i = 0; i < FFMIN(ra->nb_blocks, READAHEAD_MAX_THREADS); i++) {
+      ra->threads[i] = SDL_CreateThread(readahead_worker, "readahead", ra);
+      if(!ra->threads[i])
+        goto fail;
+      ra->nb_threads++;
+    }
+  }
+
+  buffer = (uint8_t *)av_malloc(READAHEAD_BUFFER_SIZE);
+  if(buffer)
+    ra->pb = avio_alloc_context(buffer, READAHEAD_BUFFER_SIZE, 0, ra,
+                                readahead_read, NULL, readahead_seek);
+  if(!ra->pb) {
+    av_free(buffer);
+    ret = AVERROR(ENOMEM);
+    goto fail;
+  }
+  ra->pb->seekable = AVIO_SEEKABLE_NORMAL;
+  *pb = ra->pb;
+  return 0;
+
+ fail:
+  readahead_free(ra);
+  return ret;
+}
+
+void readahead_io_close(AVIOContext **pb) {
+  ReadAhead *ra;
+
+  if(!*pb)
+    return;
+  ra = (ReadAhead *)(*pb)->opaque;
+  av_freep(&(*pb)->buffer);
+  avio_context_free(pb);
+  readahead_free(ra);
+}
+
+void readahead_io_stats(AVIOContext *pb, int64_t *buffered, int64_t *direct,
+                        int *waits, int64_t *wait_time) {
+  ReadAhead *ra = (ReadAhead *)pb->opaque;
+
+  *buffered = ra->buffered;
+  *direct = ra->direct;
+  *waits = ra->waits;
+  *wait_time = ra->wait_time;
+}
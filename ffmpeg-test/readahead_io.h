@@ -0,0 +1,32 @@
+#ifndef READAHEAD_IO_H
+#define READAHEAD_IO_H
+
+// AVIOContext for local files on slow storage (NFS, spinning disks):
+// worker threads keep a window of large aligned blocks read ahead of the
+// demuxer so a stalling filesystem is paid for in the background rather
+// than in av_read_frame. A jump of the read cursor (av_seek_frame)
+// drops the window and starts filling it at the new position.
+
+extern "C"
+{
+#include <libavformat/avio.h>
+}
+#include <stdint.h>
+
+/* nb_blocks blocks of block_size bytes ahead of the cursor; with 0 every
+   read is a synchronous pread, which is the baseline to compare with.
+   latency_us is slept before every block read to mimic slow storage.
+   int_cb, if set, is polled while waiting for a block. */
+int readahead_io_open(AVIOContext **pb, const char *filename,
+                      int nb_blocks, int block_size, int latency_us,
+                      const AVIOInterruptCB *int_cb);
+
+/* Stops the workers, closes and frees, sets *pb to NULL. */
+void readahead_io_close(AVIOContext **pb);
+
+/* Bytes that went through the AVIO buffer / straight to the caller, and
+   how often and for how long (us) the demuxer had to wait for a block. */
+void readahead_io_stats(AVIOContext *pb, int64_t *buffered, int64_t *direct,
+                        int *waits, int64_t *wait_time);
+
+#endif // READAHEAD_IO_H